@@ -1,6 +1,11 @@
 #ifndef ADC_C
 #define ADC_C
 
+#include "filter.c"
+#include "debounce.c"
+#include "spi_link.c"
+#include "thermistor_table.h"
+
 #define N_ADC_CHANNELS      24
 #define LSBS_PER_VOLT       1820.44 // V_REF (Nominally 2.5V) / 4096 bits
 #define THERMISTOR_NOMINAL  2500.0
@@ -15,12 +20,15 @@ typedef struct
 {
     unsigned int16 raw;
     unsigned int16 samples[N_TEMPERATURE_SAMPLES];
+    filter_t       filter;
     unsigned int16 average;
-    float          converted;
-    unsigned int8  ot_count; // Critical temperature error counter
-    unsigned int8  wt_count; // Temperature warning counter
+    debounce_t     ot; // Critical temperature debounce
+    debounce_t     wt; // Temperature warning debounce
 } temperature_t;
 
+// NOTE: The thermistor parameters above are baked into thermistor_table.h
+// Rerun gen_thermistor_table.py after changing any of them
+
 // ADC channels on PCB are not mapped in order
 // These two arrays are lookup tables to correctly map the channels
 
@@ -36,6 +44,19 @@ static unsigned int8 g_channel_map1[12] = {7,6,5,4,3,2,1,0,11,10,9,8};
 // ADC index:       15, 14, 13, 12, 16, 17, 18, 19, 20, 21, 22, 23
 static unsigned int8 g_channel_map2[12] = {15,14,13,12,16,17,18,19,20,21,22,23};
 
+// Each ADS7952 is read with 12 frames of 2 bytes, one transaction per frame
+#define N_ADS7952_FRAMES 24
+
+// Frame transmit data. Auto-1 mode, the power down bit must be set 1 frame
+// before the last frame. The chip powers down after the 16-th falling edge
+// of SCK.
+static unsigned int8 g_ads_tx_frame[2]     = {0x20, 0x00};
+static unsigned int8 g_ads_tx_powerdown[2] = {0x20, 0x10};
+
+static unsigned int8   g_ads_rx[N_ADS7952_FRAMES][2];
+static temperature_t * gp_ads_dest;
+static unsigned int16  g_ads_fail_run = 0; // Sweeps in a row that failed, retry included
+
 // Configures the ADS7952 to operate in Auto-1 Mode
 void ads7952_init(void)
 {
@@ -67,74 +88,174 @@ void ads7952_init(void)
     spi_write2(0xFF);
     spi_write2(0xFF);
     output_high(ADC2_SEL);
+    
+    g_ads_fail_run = 0;
 }
 
-// Reads all the channel voltages
-// Expects an array of size 12 as an input
-void ads7952_read_all_channels(temperature_t * adc)
+// Checks the channel address of every frame of the last sweep
+// Each ADS7952 must report each of its 12 channels exactly once, otherwise
+// a frame was corrupted on the bus
+int1 ads7952_frames_valid(void)
 {
     int i;
-    int ch;
-    int msb;
-    int lsb;
+    unsigned int8  ch;
+    unsigned int16 seen1 = 0;
+    unsigned int16 seen2 = 0;
     
-    for (i = 0 ; i < 12 ; i ++)
+    for (i = 0 ; i < N_ADS7952_FRAMES ; i++)
     {
-        output_low(ADC1_SEL);
-        msb = spi_read2(0x20);
+        ch = g_ads_rx[i][0] >> 4;
+        if (ch >= 12)
+        {
+            return false;
+        }
         
-        // The power down bit must be set 1 frame before the last frame.
-        // The chip powers down after the 16-th falling edge of SCK.
-        if (i == 10)
+        if (i < 12)
         {
-            lsb = spi_read2(0x10);
+            bit_set(seen1, ch);
         }
         else
         {
-            lsb = spi_read2(0x00);
+            bit_set(seen2, ch);
+        }
+    }
+    
+    return ((seen1 == 0x0FFF) && (seen2 == 0x0FFF));
+}
+
+// Stores the channel readings of the last sweep
+void ads7952_store_frames(void)
+{
+    int i;
+    unsigned int8 ch;
+    unsigned int8 msb;
+    unsigned int8 lsb;
+    
+    for (i = 0 ; i < N_ADS7952_FRAMES ; i++)
+    {
+        msb = g_ads_rx[i][0];
+        lsb = g_ads_rx[i][1];
+        ch  = msb >> 4;
+        if (i < 12)
+        {
+            gp_ads_dest[g_channel_map1[ch]].raw = ((0x0F & (unsigned int16)msb) << 8 ) | lsb;
+        }
+        else
+        {
+            gp_ads_dest[g_channel_map2[ch]].raw = ((0x0F & (unsigned int16)msb) << 8 ) | lsb;
         }
-        output_high(ADC1_SEL);
-        
-        ch = msb >> 4;
-        adc[g_channel_map1[ch]].raw = ((0x0F & msb) << 8 ) | lsb;
     }
+}
+
+// Queues the frames that read all the channel voltages on SPI2
+// Returns immediately, ads7952_finish_read_all_channels() stores the readings
+// Expects an array of size 24 as an input
+void ads7952_start_read_all_channels(temperature_t * adc)
+{
+    int i;
+    spi_txn_t txn;
     
-    for (i = 12 ; i < 24 ; i ++)
+    gp_ads_dest = adc;
+    
+    txn.mux       = SPI_NO_MUX;
+    txn.length    = 2;
+    txn.tx_length = 2;
+    txn.callback  = 0;
+    
+    for (i = 0 ; i < N_ADS7952_FRAMES ; i++)
     {
-        output_low(ADC2_SEL);
-        msb = spi_read2(0x20);
+        if (i < 12)
+        {
+            txn.cs_pin = ADC1_SEL;
+        }
+        else
+        {
+            txn.cs_pin = ADC2_SEL;
+        }
         
-        // The power down bit must be set 1 frame before the last frame.
-        // The chip powers down after the 16-th falling edge of SCK.
-        if (i == 22)
+        if ((i == 10) || (i == 22))
         {
-            lsb = spi_read2(0x10);
+            txn.tx = g_ads_tx_powerdown;
         }
         else
         {
-            lsb = spi_read2(0x00);
+            txn.tx = g_ads_tx_frame;
         }
-        output_high(ADC2_SEL);
         
-        ch = (msb >> 4);
-        adc[g_channel_map2[ch]].raw = ((0x0F & msb) << 8 ) | lsb;
+        txn.rx  = g_ads_rx[i];
+        txn.tag = i;
+        spi_dma_submit(SPI_BUS_ADC, &txn);
     }
 }
 
-float thermistor_convert_data(unsigned int16 raw)
+// Waits for the sweep in flight, returns 1 if it completed with every
+// channel address intact
+int1 ads7952_wait_sweep(void)
+{
+    if (spi_dma_wait(SPI_BUS_ADC) == false)
+    {
+        spi_link_timeout(SPI_BUS_ADC);
+        return false;
+    }
+    return ads7952_frames_valid();
+}
+
+// Waits for the sweep to complete and stores the readings
+// A sweep with a bad channel address slows SPI2 down and is read once more.
+// Returns false, leaving the previous readings in place, if that fails too.
+// Such a sweep counts towards the fail run, which the protection task trips on.
+int1 ads7952_finish_read_all_channels(void)
+{
+    int1 b_valid;
+    
+    b_valid = ads7952_wait_sweep();
+    spi_link_report(SPI_BUS_ADC, b_valid == false);
+    
+    if (b_valid == false)
+    {
+        ads7952_start_read_all_channels(gp_ads_dest);
+        b_valid = ads7952_wait_sweep();
+    }
+    
+    if (b_valid == true)
+    {
+        ads7952_store_frames();
+        g_ads_fail_run = 0;
+    }
+    else if (g_ads_fail_run < 0xFFFF)
+    {
+        g_ads_fail_run++;
+    }
+    
+    return b_valid;
+}
+
+// Returns the number of sweeps in a row that failed, 0 if the last one passed
+unsigned int16 ads7952_fail_run(void)
+{
+    return g_ads_fail_run;
+}
+
+// Reads all the channel voltages
+// Expects an array of size 24 as an input
+int1 ads7952_read_all_channels(temperature_t * adc)
+{
+    ads7952_start_read_all_channels(adc);
+    return ads7952_finish_read_all_channels();
+}
+
+// Converts a raw ADS7952 code to a temperature in 0.1 degC
+// Linearly interpolates the precomputed Steinhart-Hart table
+signed int16 thermistor_convert_data(unsigned int16 raw)
 {
-    float resistance;
-    float temperature;
+    unsigned int16 i;
+    signed int32   delta;
     
-    resistance = THERMISTOR_SERIES * (float)(raw) / (LSBS_PER_VOLT * THERMISTOR_SUPPLY - (float)(raw));
-    temperature = resistance / THERMISTOR_NOMINAL;
-    temperature = log(temperature);
-    temperature /= B_COEFF;
-    temperature += 1.0 / (TEMPERATURE_NOMINAL + 273.15);
-    temperature = 1.0 / temperature;
-    temperature -= 273.15;
+    i = raw >> THERMISTOR_TABLE_SHIFT;
+    delta = (signed int32)g_thermistor_table[i+1] - g_thermistor_table[i];
+    delta = (delta * (raw & (THERMISTOR_TABLE_STEP-1))) >> THERMISTOR_TABLE_SHIFT;
     
-    return temperature;
+    return g_thermistor_table[i] + (signed int16)delta;
 }
 
 #endif
@@ -0,0 +1,271 @@
+#ifndef BALANCE_C
+#define BALANCE_C
+
+#include "ltc6804.c"
+
+// Per-cell balancing planner
+//
+// Each balancing period is split into N_BALANCE_SLOTS slots. The planner
+// estimates how much charge a cell holds above the lowest cell, from its
+// voltage difference, and turns that into the bleed time it needs to come
+// down to BALANCE_THRESHOLD above the lowest cell. Even 0.1mV over the band
+// is several periods of bleeding, so that budget is carried from period to
+// period and every slot a cell bleeds is taken off it. The cell stops when
+// its budget runs out, part way through a period if that is where it ends,
+// and only then is it estimated again from its voltage. A cell that falls
+// back into the band stops at once.
+//
+// The charge estimate uses a fixed OCV slope and bleed current. Replace
+// BALANCE_MS_PER_100UV with a per-cell value once cell capacities are known.
+//
+// A thermal governor caps how many cells of each LTC6804 bleed at once, from
+// the die temperature of the chip and the hottest thermistor on the board.
+// When more cells need bleeding than the cap allows, the cells of a chip take
+// turns slot by slot so all of them make progress.
+//
+// test/test_balance.c runs the planner against simulated packs.
+
+#define BALANCE_PERIOD_MS 2000 // Balancing discharge period
+#define BALANCE_THRESHOLD  500 // Voltage threshold for balancing to occur (BALANCE_THRESHOLD / 10) mV
+#define N_BALANCE_SLOTS      8
+#define BALANCE_SLOT_MS   (BALANCE_PERIOD_MS/N_BALANCE_SLOTS)
+
+// Bleed time that removes the charge behind 0.1mV of cell voltage
+// 3.4mAh per mV of OCV slope (1224mAs per 0.1mV) at a 110mA bleed current
+#define BALANCE_MS_PER_100UV 11127
+
+// Thermal limits in 0.1 degC. At or below FULL every cell of a chip may
+// bleed, at or above MAX none may, and the cap falls linearly in between.
+#define BALANCE_DIE_TEMP_FULL    600
+#define BALANCE_DIE_TEMP_MAX     850
+#define BALANCE_BOARD_TEMP_FULL  400
+#define BALANCE_BOARD_TEMP_MAX   550 // Below TEMP_WARNING
+#define N_CELLS_PER_LTC6804       12
+
+// Planner states, reported over CAN
+typedef enum
+{
+    BALANCE_IDLE     = 0, // No balancing period running
+    BALANCE_BLEEDING = 1, // Balancing period running
+    BALANCE_BALANCED = 2, // Last plan found every cell within the band
+} balance_state_t;
+
+typedef struct
+{
+    balance_state_t state;
+    unsigned int8   lowest;    // Index of the lowest cell
+    unsigned int8   n_active;  // Cells bleeding this period
+    unsigned int8   slot;      // Current slot of the balancing period
+    unsigned int16  max_delta; // Largest voltage above the lowest cell, 0.1mV
+    unsigned int32  eta_ms;    // Bleed time left of the cell furthest from the band
+} balance_plan_t;
+
+static balance_plan_t g_balance;
+static unsigned int32 g_balance_budget_ms[N_CELLS]; // Bleed time each cell has left, kept across periods
+static unsigned int8  g_balance_cap[N_LTC6804];  // Cells of each chip allowed to bleed at once
+static unsigned int8  g_balance_next[N_LTC6804]; // Cell of each chip first in line next slot
+
+void balance_init(void)
+{
+    int i;
+    
+    g_balance.state     = BALANCE_IDLE;
+    g_balance.lowest    = 0;
+    g_balance.n_active  = 0;
+    g_balance.slot      = 0;
+    g_balance.max_delta = 0;
+    g_balance.eta_ms    = 0;
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_balance_budget_ms[i] = 0;
+    }
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        g_balance_cap[i]  = N_CELLS_PER_LTC6804;
+        g_balance_next[i] = 0;
+    }
+}
+
+// Returns the number of cells of a chip allowed to bleed at a temperature
+unsigned int8 balance_derate(signed int16 temp, signed int16 full, signed int16 max)
+{
+    if (temp <= full)
+    {
+        return N_CELLS_PER_LTC6804;
+    }
+    else if (temp >= max)
+    {
+        return 0;
+    }
+    return ((int32)(max - temp) * N_CELLS_PER_LTC6804) / (max - full);
+}
+
+// Sets the bleed cap of each chip from its die temperature and the hottest
+// board thermistor, both in 0.1 degC
+void balance_govern(signed int16 board_temp)
+{
+    int i;
+    unsigned int8 board_cap;
+    
+    board_cap = balance_derate(board_temp, BALANCE_BOARD_TEMP_FULL, BALANCE_BOARD_TEMP_MAX);
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        g_balance_cap[i] = balance_derate(g_ltc6804_die_temp[i], BALANCE_DIE_TEMP_FULL, BALANCE_DIE_TEMP_MAX);
+        if (board_cap < g_balance_cap[i])
+        {
+            g_balance_cap[i] = board_cap;
+        }
+    }
+}
+
+// Plans the next balancing period from the averaged cell voltages
+// Cells with bleed time left from earlier periods keep it
+void balance_plan(cell_t * cell)
+{
+    int i;
+    unsigned int16 delta;
+    
+    g_balance.lowest = 0;
+    for (i = 1 ; i < N_CELLS ; i++)
+    {
+        if (cell[i].average_voltage < cell[g_balance.lowest].average_voltage)
+        {
+            g_balance.lowest = i;
+        }
+    }
+    
+    g_balance.n_active  = 0;
+    g_balance.slot      = 0;
+    g_balance.max_delta = 0;
+    g_balance.eta_ms    = 0;
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        delta = cell[i].average_voltage - cell[g_balance.lowest].average_voltage;
+        if (delta > g_balance.max_delta)
+        {
+            g_balance.max_delta = delta;
+        }
+        
+        if (delta <= BALANCE_THRESHOLD)
+        {
+            g_balance_budget_ms[i] = 0;
+            continue;
+        }
+        
+        if (g_balance_budget_ms[i] == 0)
+        {
+            g_balance_budget_ms[i] = (unsigned int32)(delta - BALANCE_THRESHOLD) * BALANCE_MS_PER_100UV;
+        }
+        if (g_balance_budget_ms[i] > g_balance.eta_ms)
+        {
+            g_balance.eta_ms = g_balance_budget_ms[i];
+        }
+        g_balance.n_active++;
+    }
+    
+    if (g_balance.n_active == 0)
+    {
+        g_balance.state = BALANCE_BALANCED;
+    }
+    else
+    {
+        g_balance.state = BALANCE_BLEEDING;
+    }
+}
+
+// Sets the discharge bit of one cell
+void balance_set_discharge(unsigned int8 cell)
+{
+    if (cell < 12)
+    {
+        g_discharge1 |= 1 << cell;
+    }
+    else if (cell < 24)
+    {
+        g_discharge2 |= 1 << (cell - 12);
+    }
+    else
+    {
+        g_discharge3 |= 1 << (cell - 24);
+    }
+}
+
+// Picks the cells that bleed in a slot and sets their discharge bits
+// Each chip bleeds at most its capped number of cells, taken in turn from
+// the cells that still have bleed time left. A partial last slot counts as
+// a whole one.
+void balance_apply_slot(unsigned int8 slot)
+{
+    unsigned int8 chip;
+    unsigned int8 first;
+    unsigned int8 n;
+    unsigned int8 k;
+    unsigned int8 cell;
+    unsigned int8 picked;
+    
+    g_balance.slot = slot;
+    g_discharge1 = 0x000;
+    g_discharge2 = 0x000;
+    g_discharge3 = 0x000;
+    
+    for (chip = 0 ; chip < N_LTC6804 ; chip++)
+    {
+        first = chip * N_CELLS_PER_LTC6804;
+        n = N_CELLS - first;
+        if (n > N_CELLS_PER_LTC6804)
+        {
+            n = N_CELLS_PER_LTC6804;
+        }
+        
+        picked = 0;
+        for (k = 0 ; (k < n) && (picked < g_balance_cap[chip]) ; k++)
+        {
+            cell = first + ((g_balance_next[chip] + k) % n);
+            if (g_balance_budget_ms[cell] > 0)
+            {
+                balance_set_discharge(cell);
+                if (g_balance_budget_ms[cell] > BALANCE_SLOT_MS)
+                {
+                    g_balance_budget_ms[cell] -= BALANCE_SLOT_MS;
+                }
+                else
+                {
+                    g_balance_budget_ms[cell] = 0;
+                }
+                picked++;
+            }
+        }
+        
+        // The next slot starts after the last cell looked at
+        g_balance_next[chip] = (g_balance_next[chip] + k) % n;
+    }
+}
+
+// Returns the slot of the balancing period that elapsed_ms falls in
+unsigned int8 balance_slot(unsigned int32 elapsed_ms)
+{
+    return elapsed_ms / BALANCE_SLOT_MS;
+}
+
+// Ends the balancing period, the bleed time left carries into the next plan
+void balance_end(void)
+{
+    if (g_balance.state == BALANCE_BLEEDING)
+    {
+        g_balance.state = BALANCE_IDLE;
+    }
+}
+
+// Stops balancing, the next plan starts from fresh estimates
+void balance_stop(void)
+{
+    int i;
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_balance_budget_ms[i] = 0;
+    }
+    balance_end();
+}
+
+#endif
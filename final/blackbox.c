@@ -0,0 +1,161 @@
+#ifndef BLACKBOX_C
+#define BLACKBOX_C
+
+#include "timebase.c"
+#include "ltc6804.c"
+#include "adc.c"
+
+// Black box of the last N_BLACKBOX_FRAMES acquisition cycles
+//
+// Every complete scan stores the cell voltages and thermistor codes the
+// protection checks saw, the raw pack current and the time. To save RAM the
+// voltages and temperatures are stored as 8 bit differences to the previous
+// frame, and only the oldest frame in the ring is kept in full. A difference
+// that does not fit is clipped and the rest is carried into the next frame,
+// so a step shows up as a steep ramp instead of being lost. The current is
+// stored in full since it can step by hundreds of codes between scans.
+//
+// The ring is frozen when the pack trips so the cycles leading up to the
+// trip are kept until they are read out.
+
+#define N_BLACKBOX_FRAMES 32
+#define N_BLACKBOX_DELTAS (N_CELLS + N_ADC_CHANNELS)
+
+// Decoded frame: voltages, temperatures, then current and time
+#define BLACKBOX_CURRENT  N_BLACKBOX_DELTAS
+#define BLACKBOX_TIME     (N_BLACKBOX_DELTAS + 1)
+#define N_BLACKBOX_VALUES (N_BLACKBOX_DELTAS + 2)
+
+#define BLACKBOX_DELTA_MAX 127
+
+typedef struct
+{
+    signed int8    delta[N_BLACKBOX_DELTAS]; // Change since the previous frame
+    unsigned int16 current;                  // Raw hall sensor code
+    unsigned int16 time_ms;                  // Low 16 bits of timebase_ms()
+} blackbox_frame_t;
+
+static blackbox_frame_t g_blackbox[N_BLACKBOX_FRAMES];
+static unsigned int16   g_blackbox_base[N_BLACKBOX_DELTAS]; // Readings of the oldest frame
+static unsigned int16   g_blackbox_last[N_BLACKBOX_DELTAS]; // Readings of the newest frame
+static unsigned int8    g_blackbox_oldest = 0;
+static unsigned int8    g_blackbox_count = 0;
+static int1             gb_blackbox_frozen = false;
+
+void blackbox_init(void)
+{
+    g_blackbox_oldest  = 0;
+    g_blackbox_count   = 0;
+    gb_blackbox_frozen = false;
+}
+
+// Returns the reading of one delta encoded channel
+unsigned int16 blackbox_reading(cell_t * cell, temperature_t * temperature, int i)
+{
+    if (i < N_CELLS)
+    {
+        return cell[i].voltage;
+    }
+    return temperature[i - N_CELLS].average;
+}
+
+// Adds the readings of a complete scan, the oldest frame is dropped when full
+void blackbox_record(cell_t * cell, temperature_t * temperature, unsigned int16 current)
+{
+    int i;
+    unsigned int8 slot;
+    signed int16 delta;
+    blackbox_frame_t * frame;
+    
+    if (gb_blackbox_frozen == true)
+    {
+        return;
+    }
+    
+    if (g_blackbox_count == 0)
+    {
+        // First frame, kept in full
+        for (i = 0 ; i < N_BLACKBOX_DELTAS ; i++)
+        {
+            g_blackbox_base[i] = blackbox_reading(cell, temperature, i);
+            g_blackbox_last[i] = g_blackbox_base[i];
+        }
+    }
+    else if (g_blackbox_count == N_BLACKBOX_FRAMES)
+    {
+        // Drop the oldest frame, the next one becomes the base
+        g_blackbox_oldest = (g_blackbox_oldest + 1) % N_BLACKBOX_FRAMES;
+        for (i = 0 ; i < N_BLACKBOX_DELTAS ; i++)
+        {
+            g_blackbox_base[i] += g_blackbox[g_blackbox_oldest].delta[i];
+        }
+        g_blackbox_count--;
+    }
+    
+    slot = (g_blackbox_oldest + g_blackbox_count) % N_BLACKBOX_FRAMES;
+    frame = &g_blackbox[slot];
+    for (i = 0 ; i < N_BLACKBOX_DELTAS ; i++)
+    {
+        delta = blackbox_reading(cell, temperature, i) - g_blackbox_last[i];
+        if (delta > BLACKBOX_DELTA_MAX)
+        {
+            delta = BLACKBOX_DELTA_MAX;
+        }
+        else if (delta < -BLACKBOX_DELTA_MAX)
+        {
+            delta = -BLACKBOX_DELTA_MAX;
+        }
+        frame->delta[i] = delta;
+        g_blackbox_last[i] += delta;
+    }
+    frame->current = current;
+    frame->time_ms = timebase_ms();
+    g_blackbox_count++;
+}
+
+// Stops recording so the frames can be read out
+void blackbox_freeze(void)
+{
+    gb_blackbox_frozen = true;
+}
+
+// Resumes recording
+void blackbox_thaw(void)
+{
+    gb_blackbox_frozen = false;
+}
+
+int1 blackbox_frozen(void)
+{
+    return gb_blackbox_frozen;
+}
+
+// Returns the number of frames held
+unsigned int8 blackbox_count(void)
+{
+    return g_blackbox_count;
+}
+
+// Decodes frame n, oldest first, into N_BLACKBOX_VALUES values
+// Frames must be decoded in order, frame n is built on top of frame n-1
+void blackbox_decode(unsigned int8 n, unsigned int16 * values)
+{
+    int i;
+    blackbox_frame_t * frame = &g_blackbox[(g_blackbox_oldest + n) % N_BLACKBOX_FRAMES];
+    
+    for (i = 0 ; i < N_BLACKBOX_DELTAS ; i++)
+    {
+        if (n == 0)
+        {
+            values[i] = g_blackbox_base[i];
+        }
+        else
+        {
+            values[i] += frame->delta[i];
+        }
+    }
+    values[BLACKBOX_CURRENT] = frame->current;
+    values[BLACKBOX_TIME]    = frame->time_ms;
+}
+
+#endif
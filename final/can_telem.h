@@ -17,6 +17,7 @@
 // X macro table of CANbus packets
 //        Packet name            ,    ID, Length
 #define CAN_ID_TABLE(ENTRY)                                              \
+    ENTRY(CAN_BPS_SNAPSHOT       , 0x60C,  8, g_bps_snapshot_page)       \
     ENTRY(CAN_BPS_VOLTAGE1       , 0x600,  8, g_bps_voltage_page)        \
     ENTRY(CAN_BPS_VOLTAGE2       , 0x601,  8, g_bps_voltage_page+8)      \
     ENTRY(CAN_BPS_VOLTAGE3       , 0x602,  8, g_bps_voltage_page+16)     \
@@ -25,11 +26,27 @@
     ENTRY(CAN_BPS_TEMPERATURE2   , 0x609,  8, g_bps_temperature_page+8)  \
     ENTRY(CAN_BPS_TEMPERATURE3   , 0x60A,  8, g_bps_temperature_page+16) \
     ENTRY(CAN_BPS_CUR_BAL_STAT   , 0x60B,  8, g_bps_cur_bal_stat_page)
-#define N_CAN_ID 8
+#define N_CAN_ID 9
 
 enum {CAN_ID_TABLE(EXPAND_AS_CAN_ID_ENUM)};
 enum {CAN_ID_TABLE(EXPAND_AS_CAN_LEN_ENUM)};
 
+// X macro table of diagnostic CANbus packets
+// One diagnostic packet is sent after every full cycle of CAN_ID_TABLE
+//        Packet name            ,    ID, Length
+#define CAN_DIAG_TABLE(ENTRY)                                            \
+    ENTRY(CAN_BPS_ACQ_TIMING     , 0x610,  8, g_bps_acq_timing_page)     \
+    ENTRY(CAN_BPS_LTC_ERRORS     , 0x611,  8, g_bps_ltc_errors_page)     \
+    ENTRY(CAN_BPS_SPI_LINK       , 0x612,  8, g_bps_spi_link_page)       \
+    ENTRY(CAN_BPS_BALANCE        , 0x613,  8, g_bps_balance_page)        \
+    ENTRY(CAN_BPS_THERMAL        , 0x614,  8, g_bps_thermal_page)        \
+    ENTRY(CAN_BPS_TASK_WCET      , 0x615,  8, g_bps_task_wcet_page)      \
+    ENTRY(CAN_BPS_TASK_STATS     , 0x616,  8, g_bps_task_stats_page)
+#define N_CAN_DIAG 7
+
+enum {CAN_DIAG_TABLE(EXPAND_AS_CAN_ID_ENUM)};
+enum {CAN_DIAG_TABLE(EXPAND_AS_CAN_LEN_ENUM)};
+
 
 //////////////////////////
 // TELEMETRY_DEFINES /////
@@ -70,8 +87,13 @@ enum {TELEM_ID_TABLE(EXPAND_AS_TELEM_LEN_ENUM)};
     ENTRY(RESPONSE_MPPT1                , 0x771) \
     ENTRY(RESPONSE_MPPT2                , 0x772) \
     ENTRY(RESPONSE_MPPT3                , 0x773) \
-    ENTRY(RESPONSE_MPPT4                , 0x774)
-#define N_CAN_MISC 9
+    ENTRY(RESPONSE_MPPT4                , 0x774) \
+    ENTRY(COMMAND_BPS_FAULT_HISTORY     , 0x889) \
+    ENTRY(RESPONSE_BPS_FAULT_RECORD1    , 0x620) \
+    ENTRY(RESPONSE_BPS_FAULT_RECORD2    , 0x621) \
+    ENTRY(COMMAND_BPS_BLACKBOX          , 0x88A) \
+    ENTRY(RESPONSE_BPS_BLACKBOX         , 0x622)
+#define N_CAN_MISC 14
 
 enum {CAN_MISC_TABLE(EXPAND_AS_MISC_ID_ENUM)};
 
@@ -0,0 +1,64 @@
+#ifndef DEBOUNCE_C
+#define DEBOUNCE_C
+
+#include "timebase.c"
+
+// Time based fault debounce
+// A fault trips once every sample has shown it for at least the hold time of
+// its class, measured on the millisecond timebase, so the trip latency does
+// not depend on how often the checks happen to run. Once tripped it stays
+// tripped until a good sample is seen. The start time keeps the low 16 bits
+// of timebase_ms(), so hold times must stay below 32768ms.
+//
+// test/test_debounce.c checks the worst case trip latency of every class at
+// the rates the protection task samples it.
+
+// Time a fault must persist before the pack trips, per fault class
+#define OV_DEBOUNCE_MS           300
+#define UV_DEBOUNCE_MS           300
+#define OT_DEBOUNCE_MS           300
+#define WT_DEBOUNCE_MS           300 // Warning temperature while charging
+#define OC_DEBOUNCE_MS           300
+#define UC_DEBOUNCE_MS           300
+#define LINK_DEBOUNCE_MS         300 // Every read of a sensor failing
+
+typedef struct
+{
+    unsigned int16 since_ms;  // Time of the first bad sample in a row
+    int1           b_bad;     // Last sample was bad
+    int1           b_tripped; // Bad for at least the hold time
+} debounce_t;
+
+void debounce_init(debounce_t * debounce)
+{
+    debounce->since_ms  = 0;
+    debounce->b_bad     = false;
+    debounce->b_tripped = false;
+}
+
+// Takes a sample, returns 1 once it has been bad for hold_ms
+int1 debounce_update(debounce_t * debounce, int1 b_bad, unsigned int16 hold_ms)
+{
+    unsigned int16 now;
+    
+    if (b_bad == false)
+    {
+        debounce->b_bad     = false;
+        debounce->b_tripped = false;
+        return false;
+    }
+    
+    now = timebase_ms();
+    if (debounce->b_bad == false)
+    {
+        debounce->b_bad    = true;
+        debounce->since_ms = now;
+    }
+    if ((unsigned int16)(now - debounce->since_ms) >= hold_ms)
+    {
+        debounce->b_tripped = true;
+    }
+    return debounce->b_tripped;
+}
+
+#endif
@@ -1,27 +1,42 @@
 #ifndef EEPROM_C
 #define EEPROM_C
 
+#include "timebase.c"
+
 // 2Kb I2C serial CMOS eeprom: CAT24AA02
 // Datasheet: http://www.onsemi.com/pub_link/Collateral/CAT24AA01-D.PDF
 
+// The whole eeprom is read into a RAM shadow by eeprom_init() at boot. Reads
+// are served from the shadow and writes only change the shadow and mark its
+// page dirty. eeprom_service() is called every millisecond and writes one
+// dirty page at a time back with a page write, then polls the device for an
+// ACK to find out when the internal write cycle is over instead of waiting
+// out the worst case write time. Nothing on the trip path waits on I2C.
+
 #define I2C_WRITE_BIT 0
 #define I2C_READ_BIT  1
 
 // I2C address of the device, 0b101000 + LSB
 #define DEVICE_ADDRESS  0xA0
 
-// The device has memory addresses from 0x00 to 0x100
+// The device has memory addresses from 0x00 to 0xFF
 #define BASE_ADDRESS    0x00
 #define OV_ADDRESS      0x00
-#define UV_ADDRESS      0x04
-#define OT_ADDRESS      0x08
-#define CURRENT_ADDRESS 0x0B
+#define UV_ADDRESS      0x01
+#define OT_ADDRESS      0x02
+#define CURRENT_ADDRESS 0x03
+
+#define EEPROM_SIZE      256
+#define EEPROM_PAGE_SIZE  16 // Bytes written by one page write
+#define N_EEPROM_PAGES   (EEPROM_SIZE/EEPROM_PAGE_SIZE)
 
 // The eeprom will store 4 bytes of error data
 #define N_ERROR_BYTES 4
 
-// The EEPROM takes 5ms to write data to memory
+// The EEPROM takes up to 5ms to write data to memory
+// A write cycle that has not finished after twice that is given up on
 #define WRITE_TIME_MS 5
+#define WRITE_TIMEOUT_MS (2*WRITE_TIME_MS)
 
 #define EEPROM_SUCCESS 0xFF
 
@@ -36,54 +51,145 @@ static int8 g_uv_error = EEPROM_SUCCESS;
 static int8 g_ot_error = EEPROM_SUCCESS;
 static int8 g_current_error = EEPROM_SUCCESS;
 
-// Writes an error code to the eeprom
-void eeprom_write_errors(void)
+static int8           g_eeprom_shadow[EEPROM_SIZE];
+static unsigned int16 g_eeprom_dirty = 0; // One bit per page waiting to be written
+static int1           gb_eeprom_writing = false; // Write cycle in progress
+static unsigned int8  g_eeprom_page;             // Page of the write cycle
+static unsigned int32 g_eeprom_write_ms;         // Start of the write cycle
+static unsigned int8  g_eeprom_failures = 0;     // Write cycles that timed out
+
+// Reads the whole eeprom into the shadow with one sequential read
+void eeprom_init(void)
 {
-    // Write the error code
-    output_low(WP_PIN);
+    unsigned int16 i;
+    
     i2c_start();
     i2c_write(DEVICE_ADDRESS|I2C_WRITE_BIT);
     i2c_write(BASE_ADDRESS);
-    i2c_write(g_ov_error);              // Byte 0 - OV error
-    i2c_write(g_uv_error);              // Byte 1 - UV error
-    i2c_write(g_ot_error);              // Byte 2 - OT error
-    i2c_write((int8)(g_current_error)); // Byte 3 - Current error
+    i2c_start();
+    i2c_write(DEVICE_ADDRESS|I2C_READ_BIT);
+    for (i = 0 ; i < EEPROM_SIZE ; i++)
+    {
+        // ACK every byte but the last
+        g_eeprom_shadow[i] = i2c_read(i < (EEPROM_SIZE-1));
+    }
     i2c_stop();
-    output_high(WP_PIN);
-    delay_ms(WRITE_TIME_MS);
+    
+    g_eeprom_dirty = 0;
+    gb_eeprom_writing = false;
 }
 
-// Reads the contents of the eeprom
-void eeprom_read(int8 * data)
+// Returns a byte of the eeprom
+int8 eeprom_read_byte(unsigned int8 address)
+{
+    return g_eeprom_shadow[address];
+}
+
+// Writes a byte of the eeprom, the page is written back in the background
+void eeprom_write_byte(unsigned int8 address, int8 data)
+{
+    if (g_eeprom_shadow[address] != data)
+    {
+        g_eeprom_shadow[address] = data;
+        bit_set(g_eeprom_dirty, address / EEPROM_PAGE_SIZE);
+    }
+}
+
+// Returns 1 while the shadow has not been written back completely
+int1 eeprom_busy(void)
+{
+    return ((g_eeprom_dirty != 0) || (gb_eeprom_writing == true));
+}
+
+// Returns the number of write cycles that timed out
+unsigned int8 eeprom_failures(void)
+{
+    return g_eeprom_failures;
+}
+
+// Writes one page of the shadow to the eeprom
+void eeprom_write_page(unsigned int8 page)
 {
+    int i;
+    unsigned int8 address = page * EEPROM_PAGE_SIZE;
+    
     output_low(WP_PIN);
     i2c_start();
     i2c_write(DEVICE_ADDRESS|I2C_WRITE_BIT);
-    i2c_write(BASE_ADDRESS);
-    i2c_start();
-    i2c_write(DEVICE_ADDRESS|I2C_READ_BIT);
-    *(data+0) = i2c_read(1); // OV error, ACK
-    *(data+1) = i2c_read(1); // UV error, ACK
-    *(data+2) = i2c_read(1); // OT error, ACK
-    *(data+3) = i2c_read(0); // current error, NOACK, stop
+    i2c_write(address);
+    for (i = 0 ; i < EEPROM_PAGE_SIZE ; i++)
+    {
+        i2c_write(g_eeprom_shadow[address+i]);
+    }
     i2c_stop();
     output_high(WP_PIN);
 }
 
+// Writes dirty pages back, called every millisecond
+// The device does not ACK its address until the write cycle is over
+void eeprom_service(void)
+{
+    unsigned int8 page;
+    int1 b_nack;
+    
+    if (gb_eeprom_writing == true)
+    {
+        i2c_start();
+        b_nack = i2c_write(DEVICE_ADDRESS|I2C_WRITE_BIT);
+        i2c_stop();
+        
+        if (b_nack == 0)
+        {
+            gb_eeprom_writing = false;
+        }
+        else if ((timebase_ms() - g_eeprom_write_ms) >= WRITE_TIMEOUT_MS)
+        {
+            // Device missing or stuck, the page is retried
+            bit_set(g_eeprom_dirty, g_eeprom_page);
+            gb_eeprom_writing = false;
+            g_eeprom_failures++;
+        }
+        return;
+    }
+    
+    for (page = 0 ; page < N_EEPROM_PAGES ; page++)
+    {
+        if (bit_test(g_eeprom_dirty, page))
+        {
+            bit_clear(g_eeprom_dirty, page);
+            eeprom_write_page(page);
+            gb_eeprom_writing = true;
+            g_eeprom_page = page;
+            g_eeprom_write_ms = timebase_ms();
+            return;
+        }
+    }
+}
+
+// Writes the error codes to the eeprom
+void eeprom_write_errors(void)
+{
+    eeprom_write_byte(OV_ADDRESS, g_ov_error);
+    eeprom_write_byte(UV_ADDRESS, g_uv_error);
+    eeprom_write_byte(OT_ADDRESS, g_ot_error);
+    eeprom_write_byte(CURRENT_ADDRESS, (int8)(g_current_error));
+}
+
+// Reads the error codes stored in the eeprom
+void eeprom_read(int8 * data)
+{
+    *(data+0) = eeprom_read_byte(OV_ADDRESS);      // OV error
+    *(data+1) = eeprom_read_byte(UV_ADDRESS);      // UV error
+    *(data+2) = eeprom_read_byte(OT_ADDRESS);      // OT error
+    *(data+3) = eeprom_read_byte(CURRENT_ADDRESS); // current error
+}
+
 void eeprom_clear_memory(void)
 {
-    // Write the error code
-    output_low(WP_PIN);
-    i2c_start();
-    i2c_write(DEVICE_ADDRESS|I2C_WRITE_BIT);
-    i2c_write(BASE_ADDRESS);
-    i2c_write(EEPROM_SUCCESS);              // Byte 0 - OV error
-    i2c_write(EEPROM_SUCCESS);              // Byte 1 - UV error
-    i2c_write(EEPROM_SUCCESS);              // Byte 2 - OT error
-    i2c_write((int8)(EEPROM_SUCCESS)); // Byte 3 - Current error
-    i2c_stop();
-    output_high(WP_PIN);
-    delay_ms(WRITE_TIME_MS);
+    eeprom_write_byte(OV_ADDRESS, EEPROM_SUCCESS);
+    eeprom_write_byte(UV_ADDRESS, EEPROM_SUCCESS);
+    eeprom_write_byte(OT_ADDRESS, EEPROM_SUCCESS);
+    eeprom_write_byte(CURRENT_ADDRESS, EEPROM_SUCCESS);
 }
 
 void eeprom_clear_flags(void)
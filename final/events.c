@@ -0,0 +1,27 @@
+#ifndef EVENTS_C
+#define EVENTS_C
+
+// Deferred work posted by interrupt handlers
+// An interrupt handler only posts an event, which sets one bit of g_events,
+// and returns. The main loop runs the handler of each pending event. With a
+// constant bit number, bit_set() and bit_clear() compile to single BSET and
+// BCLR instructions, so events are posted and taken without masking
+// interrupts. An event posted again before it is handled runs once. There
+// is room for 16 events.
+
+static unsigned int16 g_events = 0;
+
+// Posts an event, e must be a constant
+#define EVENT_POST(e) bit_set(g_events, e)
+
+// Runs handler if event e is pending, e must be a constant
+// The event is taken before the handler runs, so a post during the handler
+// runs it again on the next dispatch
+#define EVENT_DISPATCH(e, handler)   \
+    if (bit_test(g_events, e))       \
+    {                                \
+        bit_clear(g_events, e);      \
+        handler();                   \
+    }
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef FAULT_LOG_C
+#define FAULT_LOG_C
+
+#include "timebase.c"
+#include "pec.c"
+#include "eeprom.c"
+
+// Fault history kept in the eeprom
+//
+// Page 0 of the eeprom holds the last error bytes and the boot counter. The
+// other pages form a ring of fault records, one record per page, so a record
+// is written with a single page write and every page is written once per
+// trip through the ring. Each record carries a sequence number, the newest
+// valid record is found at boot and the next record goes in the page after
+// it. Records are checked with the same CRC15 as the LTC6804 PEC, a page
+// that was never written or whose write was cut short is skipped.
+//
+// The protection checks note each fault with the reading that caused it and
+// fault_log_commit() stores the noted faults when the pack trips.
+
+#define BOOT_COUNT_ADDRESS   0x04 // 2 bytes
+#define FAULT_LOG_FIRST_PAGE 1
+#define N_FAULT_RECORDS      (N_EEPROM_PAGES - FAULT_LOG_FIRST_PAGE)
+#define FAULT_RECORD_SIZE    EEPROM_PAGE_SIZE
+
+typedef enum
+{
+    FAULT_NONE     = 0,
+    FAULT_OV       = 1, // Cell over voltage, value in 0.1mV
+    FAULT_UV       = 2, // Cell under voltage, value in 0.1mV
+    FAULT_OT       = 3, // Thermistor over temperature, value is the ADC code
+    FAULT_WT       = 4, // Thermistor over warning temperature while charging
+    FAULT_OC       = 5, // Discharge over current, value is the hall sensor code
+    FAULT_UC       = 6, // Charge over current, value is the hall sensor code
+    FAULT_LTC_LINK = 7, // LTC6804 register group failing every read, index is
+                        // the group, value the failed reads in a row
+    FAULT_ADC_LINK = 8, // ADS7952 sweep failing every read, value the failed
+                        // sweeps in a row
+    N_FAULT_TYPES
+} fault_type_t;
+
+// Index of a current fault, the check that caught it
+#define FAULT_CURRENT_DEBOUNCED 0 // Protection task, debounced limits
+#define FAULT_CURRENT_CRITICAL  1 // ADC1 interrupt, critical limits
+
+typedef struct
+{
+    unsigned int16 seq;          // Record number, the newest record has the highest
+    unsigned int16 trip;         // Trip counter when the record was written
+    unsigned int32 timestamp_ms; // timebase_ms() when the fault was noted
+    unsigned int16 value;        // Reading that caused the fault
+    unsigned int8  type;         // fault_type_t
+    unsigned int8  index;        // Cell or thermistor channel
+    unsigned int16 boot;         // Boot counter when the record was written
+    unsigned int16 crc;          // CRC15 of the bytes above
+} fault_record_t;
+
+static unsigned int16 g_boot_count;
+static unsigned int16 g_fault_seq = 0;  // Sequence number of the next record
+static unsigned int16 g_fault_trips = 0; // Trips recorded so far
+static unsigned int8  g_fault_next = 0;  // Ring slot of the next record
+static unsigned int8  g_fault_count = 0; // Valid records in the ring
+
+// Faults noted since the last commit, one of each type
+static fault_record_t g_fault_pending[N_FAULT_TYPES];
+static int1           gb_fault_pending[N_FAULT_TYPES];
+
+// Copies a ring slot out of the eeprom shadow, returns 1 if its CRC matches
+int1 fault_log_load(unsigned int8 slot, fault_record_t * record)
+{
+    int i;
+    int8 * dest = (int8 *)record;
+    unsigned int8 address = (FAULT_LOG_FIRST_PAGE + slot) * FAULT_RECORD_SIZE;
+    
+    for (i = 0 ; i < FAULT_RECORD_SIZE ; i++)
+    {
+        dest[i] = eeprom_read_byte(address + i);
+    }
+    return (record->crc == pec15((char *)record, FAULT_RECORD_SIZE - 2));
+}
+
+// Adds the CRC to a record and stores it in a ring slot
+void fault_log_store(unsigned int8 slot, fault_record_t * record)
+{
+    int i;
+    int8 * src = (int8 *)record;
+    unsigned int8 address = (FAULT_LOG_FIRST_PAGE + slot) * FAULT_RECORD_SIZE;
+    
+    record->crc = pec15((char *)record, FAULT_RECORD_SIZE - 2);
+    for (i = 0 ; i < FAULT_RECORD_SIZE ; i++)
+    {
+        eeprom_write_byte(address + i, src[i]);
+    }
+}
+
+// Finds the newest record and counts the boot, call after eeprom_init()
+void fault_log_init(void)
+{
+    unsigned int8 slot;
+    int1 b_found = false;
+    fault_record_t record;
+    fault_record_t newest;
+    
+    g_boot_count = make16(eeprom_read_byte(BOOT_COUNT_ADDRESS), eeprom_read_byte(BOOT_COUNT_ADDRESS+1)) + 1;
+    eeprom_write_byte(BOOT_COUNT_ADDRESS, make8(g_boot_count, 1));
+    eeprom_write_byte(BOOT_COUNT_ADDRESS+1, make8(g_boot_count, 0));
+    
+    g_fault_count = 0;
+    for (slot = 0 ; slot < N_FAULT_RECORDS ; slot++)
+    {
+        if (fault_log_load(slot, &record) == true)
+        {
+            g_fault_count++;
+            if ((b_found == false) || ((signed int16)(record.seq - newest.seq) > 0))
+            {
+                newest = record;
+                g_fault_next = (slot + 1) % N_FAULT_RECORDS;
+                b_found = true;
+            }
+        }
+    }
+    
+    if (b_found == true)
+    {
+        g_fault_seq   = newest.seq + 1;
+        g_fault_trips = newest.trip;
+    }
+    
+    for (slot = 0 ; slot < N_FAULT_TYPES ; slot++)
+    {
+        gb_fault_pending[slot] = false;
+    }
+}
+
+// Notes a fault, replacing any earlier note of the same type
+void fault_log_note(fault_type_t type, unsigned int8 index, unsigned int16 value)
+{
+    g_fault_pending[type].type         = type;
+    g_fault_pending[type].index        = index;
+    g_fault_pending[type].value        = value;
+    g_fault_pending[type].timestamp_ms = timebase_ms();
+    gb_fault_pending[type] = true;
+}
+
+// Stores the noted faults as one trip, the oldest records are overwritten
+void fault_log_commit(void)
+{
+    unsigned int8 type;
+    int1 b_counted = false;
+    
+    for (type = 0 ; type < N_FAULT_TYPES ; type++)
+    {
+        if (gb_fault_pending[type] == true)
+        {
+            if (b_counted == false)
+            {
+                g_fault_trips++;
+                b_counted = true;
+            }
+            g_fault_pending[type].seq  = g_fault_seq++;
+            g_fault_pending[type].trip = g_fault_trips;
+            g_fault_pending[type].boot = g_boot_count;
+            fault_log_store(g_fault_next, &g_fault_pending[type]);
+            g_fault_next = (g_fault_next + 1) % N_FAULT_RECORDS;
+            if (g_fault_count < N_FAULT_RECORDS)
+            {
+                g_fault_count++;
+            }
+            gb_fault_pending[type] = false;
+        }
+    }
+}
+
+// Returns the number of valid records
+unsigned int8 fault_log_count(void)
+{
+    return g_fault_count;
+}
+
+// Copies the n-th valid record, oldest first, returns 0 if there is none
+int1 fault_log_get(unsigned int8 n, fault_record_t * record)
+{
+    unsigned int8 i;
+    unsigned int8 slot = g_fault_next;
+    
+    for (i = 0 ; i < N_FAULT_RECORDS ; i++)
+    {
+        if (fault_log_load(slot, record) == true)
+        {
+            if (n == 0)
+            {
+                return true;
+            }
+            n--;
+        }
+        slot = (slot + 1) % N_FAULT_RECORDS;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef FILTER_C
+#define FILTER_C
+
+// Fixed-point moving average filter
+// The samples are kept in a ring buffer along with a running sum, so each
+// update replaces the oldest sample and costs the same regardless of the
+// number of samples being averaged.
+
+typedef struct
+{
+    unsigned int16 * samples; // Ring buffer, owned by the filtered struct
+    unsigned int8    length;  // Number of samples in the ring buffer
+    unsigned int8    head;    // Index of the oldest sample
+    unsigned int32   sum;     // Running sum of all samples in the ring buffer
+} filter_t;
+
+// Attaches a sample buffer to the filter and clears it
+void filter_init(filter_t * filter, unsigned int16 * samples, unsigned int8 length)
+{
+    unsigned int8 i;
+
+    filter->samples = samples;
+    filter->length  = length;
+    filter->head    = 0;
+    filter->sum     = 0;
+
+    for (i = 0 ; i < length ; i++)
+    {
+        samples[i] = 0;
+    }
+}
+
+// Replaces the oldest sample with a new one, returns the new average
+unsigned int16 filter_update(filter_t * filter, unsigned int16 sample)
+{
+    filter->sum -= filter->samples[filter->head];
+    filter->sum += sample;
+    filter->samples[filter->head] = sample;
+
+    filter->head++;
+    if (filter->head >= filter->length)
+    {
+        filter->head = 0;
+    }
+
+    return (unsigned int16) (filter->sum/filter->length);
+}
+
+#endif
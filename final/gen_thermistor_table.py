@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""Generates thermistor_table.h, the ADS7952 code to temperature lookup table
+used by thermistor_convert_data() in adc.c
+
+The table holds one entry every THERMISTOR_TABLE_STEP codes, in 0.1 degC,
+and is linearly interpolated at run time. It also holds the raw code of
+each temperature protection limit so the safety path can compare codes.
+Rerun this script whenever the thermistor or divider parameters in adc.c
+or the temperature limits in main.c change:
+
+  python3 gen_thermistor_table.py --limit 60 --limit 70 > thermistor_table.h
+"""
+
+import argparse
+import math
+
+def steinhart_hart(code, args):
+    # Same simplified Steinhart-Hart (B parameter) equation adc.c used to run
+    full_scale = args.lsbs_per_volt * args.supply
+    code = max(code, 1) # A code of 0 (shorted thermistor) reads as the hottest entry
+    resistance = args.series * code / (full_scale - code)
+    temperature = math.log(resistance / args.nominal) / args.b_coeff
+    temperature += 1.0 / (args.temperature_nominal + 273.15)
+    return 1.0 / temperature - 273.15
+
+def main():
+    parser = argparse.ArgumentParser(description = __doc__,
+                                     formatter_class = argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--b-coeff',             type = float, default = 3350.0)
+    parser.add_argument('--series',              type = float, default = 10000.0)
+    parser.add_argument('--nominal',             type = float, default = 2500.0)
+    parser.add_argument('--temperature-nominal', type = float, default = 25.0)
+    parser.add_argument('--supply',              type = float, default = 3.3)
+    parser.add_argument('--lsbs-per-volt',       type = float, default = 1820.44)
+    parser.add_argument('--step-bits',           type = int,   default = 5)
+    parser.add_argument('--limit', type = int, action = 'append',
+                        help = 'protection limit in degC to emit a raw code for')
+    args = parser.parse_args()
+    limits = args.limit if args.limit else [60, 70] # TEMP_WARNING, TEMP_CRITICAL
+
+    step = 1 << args.step_bits
+    n_entries = 4096 // step + 1
+    table = [int(round(10.0 * steinhart_hart(i * step, args))) for i in range(n_entries)]
+    table = [max(-32768, min(32767, t)) for t in table]
+
+    # Worst case interpolation error over the range the protection limits use
+    worst = 0.0
+    for code in range(1, 4096):
+        reference = steinhart_hart(code, args)
+        if -20.0 <= reference <= 100.0:
+            i = code >> args.step_bits
+            frac = code & (step - 1)
+            approx = table[i] + (((table[i+1] - table[i]) * frac) >> args.step_bits)
+            worst = max(worst, abs(approx / 10.0 - reference))
+
+    print('#ifndef THERMISTOR_TABLE_H')
+    print('#define THERMISTOR_TABLE_H')
+    print('')
+    print('// Generated by gen_thermistor_table.py, do not edit by hand')
+    print('// B_COEFF = %g, THERMISTOR_SERIES = %g, THERMISTOR_NOMINAL = %g'
+          % (args.b_coeff, args.series, args.nominal))
+    print('// TEMPERATURE_NOMINAL = %g, THERMISTOR_SUPPLY = %g, LSBS_PER_VOLT = %g'
+          % (args.temperature_nominal, args.supply, args.lsbs_per_volt))
+    print('// Worst case interpolation error from -20 to 100 degC: %.2f degC' % worst)
+    print('')
+    print('#define THERMISTOR_TABLE_SHIFT %d' % args.step_bits)
+    print('#define THERMISTOR_TABLE_STEP  %d' % step)
+    print('#define N_THERMISTOR_TABLE     %d' % n_entries)
+    print('')
+    print('// Temperature in 0.1 degC at every THERMISTOR_TABLE_STEP ADS7952 codes')
+    print('const signed int16 g_thermistor_table[N_THERMISTOR_TABLE] =')
+    print('{')
+    for i in range(0, n_entries, 8):
+        row = ', '.join('%6d' % t for t in table[i:i+8])
+        print('    %s%s' % (row, ',' if i + 8 < n_entries else ''))
+    print('};')
+    print('')
+    print('// Largest ADS7952 code at or above each protection limit (NTC, so hotter')
+    print('// cells read lower codes). Use THERMISTOR_CODE(degc) to look one up.')
+    for limit in sorted(limits):
+        code = max(c for c in range(1, 4096) if steinhart_hart(c, args) >= limit)
+        print('#define THERMISTOR_CODE_%d %4d' % (limit, code))
+    print('#define THERMISTOR_CODE(degc) _THERMISTOR_CODE(degc)')
+    print('#define _THERMISTOR_CODE(degc) THERMISTOR_CODE_##degc')
+    print('')
+    print('#endif')
+
+if __name__ == '__main__':
+    main()
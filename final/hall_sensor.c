@@ -1,9 +1,17 @@
 #ifndef HALLSENSOR_C
 #define HALLSENSOR_C
 
+#include "filter.c"
+#include "debounce.c"
+
 // Hall sensor parameters
 #define CURRENT_ZERO           2055
-#define CURRENT_SLOPE         12.64
+#define CURRENT_SLOPE_X100     1264 // 12.64 ADC codes per amp
+#define CURRENT_SLOPE         (CURRENT_SLOPE_X100/100.0)
+
+// Converts a current in amps to a number of ADC codes away from CURRENT_ZERO
+// Integer only, so limits built from it stay in the raw ADC domain
+#define HALL_AMPS_TO_CODES(amps) ((int16)(((int32)(amps)*CURRENT_SLOPE_X100)/100))
 
 #define HALL_ADC_CHANNEL         24
 #define HALL_TEMPERATURE_CHANNEL 25
@@ -12,20 +20,101 @@
 
 #define N_CURRENT_SAMPLES 10
 
+// ADC1 samples the hall sensor on its own, with automatic sampling and
+// conversion, and interrupts after every conversion. Each sample takes
+// 31 TAD of sampling and 14 TAD of conversion with TAD = 32 Tcy, 144us in all.
+// The interrupt compares every sample against the critical limits, so a
+// short circuit opens the Kilovac after HALL_TRIP_SAMPLES samples in a row,
+// 576us at most, without waiting for the protection task. The protection
+// task reads the latest sample and keeps debouncing the moderate limits.
+#define HALL_AD1CON1      0x04E4 // 12 bit, integer, auto convert, auto sample
+#define HALL_AD1CON2      0x0000 // AVdd/AVss, no scan, interrupt every sample
+#define HALL_AD1CON3      0x1F1F // SAMC = 31 TAD, ADCS = 32 Tcy
+#define AD1CON1_ADON      15
+#define HALL_TRIP_SAMPLES 4
+
+#word AD1CON1  = getenv("SFR:AD1CON1")
+#word AD1CON2  = getenv("SFR:AD1CON2")
+#word AD1CON3  = getenv("SFR:AD1CON3")
+#word AD1CHS0  = getenv("SFR:AD1CHS0")
+#word ADC1BUF0 = getenv("SFR:ADC1BUF0")
+
 typedef struct
 {
     unsigned int16 raw;
     unsigned int16 samples[N_CURRENT_SAMPLES];
+    filter_t       filter;
     unsigned int16 average;
-    unsigned int8  oc_count; // Overcurrent error counter
-    unsigned int8  uc_count; // Undercurrent error counter
+    debounce_t     oc; // Overcurrent debounce
+    debounce_t     uc; // Undercurrent debounce
 } current_t;
 
-// Initializes the hall effect sensor interface
+static unsigned int16 g_hall_raw = CURRENT_ZERO; // Latest sample
+static unsigned int8  g_hall_trip_count = 0;     // Critical samples in a row
+static int1           gb_hall_tripped = false;
+static unsigned int16 g_hall_trip_raw = CURRENT_ZERO; // Sample of the first trip
+static int1           gb_hall_trip_discharge = false; // First trip was a discharge current
+
+// Starts sampling the hall sensor in the background
 void hall_sensor_init(void)
 {
-    setup_adc(ADC_CLOCK_INTERNAL);
     setup_adc_ports(HALL_ANALOG_PIN|HALL_TEMPERATURE_PIN);
+    AD1CON1 = HALL_AD1CON1;
+    AD1CON2 = HALL_AD1CON2;
+    AD1CON3 = HALL_AD1CON3;
+    AD1CHS0 = HALL_ADC_CHANNEL;
+    bit_set(AD1CON1, AD1CON1_ADON);
+    enable_interrupts(INT_ADC1);
+}
+
+// Takes the sample of the ADC1 interrupt and compares it to the critical
+// limits in raw codes. Returns 1 on the sample that trips
+#inline
+int1 hall_sensor_sample(unsigned int16 critical_charge, unsigned int16 critical_discharge)
+{
+    g_hall_raw = ADC1BUF0;
+    
+    if ((g_hall_raw >= critical_discharge) || (g_hall_raw <= critical_charge))
+    {
+        if (g_hall_trip_count < HALL_TRIP_SAMPLES)
+        {
+            g_hall_trip_count++;
+            if (g_hall_trip_count == HALL_TRIP_SAMPLES)
+            {
+                if (gb_hall_tripped == false)
+                {
+                    // Latched, later samples are taken with the Kilovac open
+                    g_hall_trip_raw = g_hall_raw;
+                    gb_hall_trip_discharge = (g_hall_raw >= critical_discharge);
+                    gb_hall_tripped = true;
+                }
+                return true;
+            }
+        }
+    }
+    else
+    {
+        g_hall_trip_count = 0;
+    }
+    return false;
+}
+
+// Returns 1 if the interrupt has seen a critical current
+int1 hall_sensor_tripped(void)
+{
+    return gb_hall_tripped;
+}
+
+// Returns the sample that first tripped the critical limits
+unsigned int16 hall_sensor_trip_data(void)
+{
+    return g_hall_trip_raw;
+}
+
+// Returns 1 if the first trip was on the discharge limit, 0 on the charge limit
+int1 hall_sensor_trip_discharge(void)
+{
+    return gb_hall_trip_discharge;
 }
 
 // Returns the calibrated current value from the raw adc reading
@@ -34,25 +123,22 @@ float hall_sensor_adjust_current(unsigned int16 raw_current)
    return ((float)raw_current - CURRENT_ZERO)/CURRENT_SLOPE;
 }
 
+// Returns the calibrated current in 0.1A without floating point math
+signed int16 hall_sensor_deciamps(unsigned int16 raw_current)
+{
+    return ((signed int32)raw_current - CURRENT_ZERO) * 1000 / CURRENT_SLOPE_X100;
+}
+
 // Returns 1 if current_data is a positive current reading, 0 if negative
 unsigned int8 hall_sensor_discharge(unsigned int16 current_data)
 {
     return (current_data < CURRENT_ZERO);
 }
 
-// Retrieves and returns uint16 raw current value from hall effect sensor
+// Returns the latest raw current value from hall effect sensor
 unsigned int16 hall_sensor_read_data(void)
 {
-    set_adc_channel(HALL_ADC_CHANNEL);
-    delay_us(10);
-    return((unsigned int16)(read_adc()));
-}
-
-unsigned int16 hall_sensor_read_temperature(void)
-{
-    set_adc_channel(HALL_TEMPERATURE_CHANNEL);
-    delay_us(10);
-    return((unsigned int16)(read_adc()));
+    return g_hall_raw;
 }
 
 #endif
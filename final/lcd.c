@@ -1,6 +1,8 @@
 #ifndef LCD_C
 #define LCD_C
 
+#include "timebase.c"
+
 // NOTE: In order to pass strings, add the following line to main.h
 // #device PASS_STRINGS = IN_RAM
 // Source: https://www.ccsinfo.com/forum/viewtopic.php?t=44633
@@ -8,17 +10,63 @@
 // datasheet: http://www.kyocera-display.com/SiteImages/PartList/SPEC/51847ad%C3%A9%C3%A0.pdf
 // lcd interface tutorial: http://www.8051projects.net/lcd-interfacing/lcd-4-bit.php
 
+// The LCD functions below only queue commands and characters. lcd_service()
+// is called every millisecond and sends queued entries while the LCD is not
+// busy, so updating the display never holds up the caller. The busy flag is
+// read back through RW_PIN. With LCD_USE_BUSY_FLAG set to 0 every entry is
+// instead given the worst case execution time of its instruction.
+//
+// Screens are drawn into a frame buffer with lcd_frame_clear() and
+// lcd_frame_write(). lcd_frame_flush() compares it with a shadow copy of what
+// the display shows and queues only the characters that changed, with a
+// cursor move in front of each run of changed characters.
+
 #define COMMAND_REG    0
 #define DATA_REG       1
 #define N_BITS         4 // using a 4 bit interface
-#define LCD_BUSY_DELAY 5 // time spent waiting while the lcd is busy
+#define LCD_ROWS       4
+#define LCD_COLUMNS   20
+
+#ifndef LCD_USE_BUSY_FLAG
+#define LCD_USE_BUSY_FLAG 1
+#endif
 
 // LCD pin should be debounced when connected
 #define LCD_DEBOUNCE_MS 20
 
+#define LCD_QUEUE_LENGTH   128
+#define LCD_BYTES_PER_CALL   8 // Most entries sent by one lcd_service() call
+#define LCD_BUSY_TIMEOUT_MS 10 // Queue is dropped if the LCD stays busy this long
+#define LCD_SHOWN_UNKNOWN 0xFF // Shadow character no frame uses, forces a rewrite
+
+// Instruction execution times, used before the busy flag is valid and when
+// LCD_USE_BUSY_FLAG is 0
+#define LCD_CLEAR_US    2000 // Clear display and return home
+#define LCD_COMMAND_US    50 // Every other instruction and data write
+
+// Queue entry: the byte in bits 0-7 and flags above it
+#define LCD_ENTRY_DATA    0x0100 // Write to the data register
+#define LCD_ENTRY_DELAY   0x0200 // Wait bits 0-7 milliseconds, nothing sent
+#define LCD_ENTRY_NO_BUSY 0x0400 // Sent before the busy flag is valid
+
 static int g_data_pin[4] = {D4_PIN, D5_PIN, D6_PIN, D7_PIN};
 static int g_row_address[4] = {0x00, 0x40, 0x14, 0x54};
 
+static unsigned int16 g_lcd_queue[LCD_QUEUE_LENGTH];
+static unsigned int8  g_lcd_head = 0; // Next entry to send
+static unsigned int8  g_lcd_tail = 0; // Next free slot
+
+// Time the last entry was sent and how long it holds off the next one
+static unsigned int16 g_lcd_sent_ticks = 0;
+static unsigned int16 g_lcd_hold_ticks = 0;
+
+// Time the LCD was first seen busy, and whether it is being waited on
+static unsigned int32 g_lcd_busy_since_ms = 0;
+static int1           gb_lcd_waiting = false;
+
+static char g_lcd_frame[LCD_ROWS][LCD_COLUMNS]; // Next screen to show
+static char g_lcd_shown[LCD_ROWS][LCD_COLUMNS]; // Screen on the display once the queue drains
+
 // Writes a nibble to the LCD parallel interface
 void lcd_send_nibble(int8 data)
 {
@@ -26,7 +74,7 @@ void lcd_send_nibble(int8 data)
     
     output_low(RW_PIN); // we are writing so RW pin should be low
     output_low(EN_PIN); // make sure that the EN pin is low
-
+    
     // load the nibble to the parallel interface on the lcd
     for (i = 0 ; i < N_BITS ; i++)
     {
@@ -39,44 +87,174 @@ void lcd_send_nibble(int8 data)
     output_low(EN_PIN);
 }
 
-// Writes to the data register on the LCD
-void lcd_send_data(int8 data)
+// Reads the busy flag, D7 of the first nibble of the address counter read
+int1 lcd_read_busy(void)
 {
+    int1 b_busy;
+    
+    // Release the data bus before the LCD starts driving it
+    input(D4_PIN);
+    input(D5_PIN);
+    input(D6_PIN);
+    input(D7_PIN);
+    
     output_low(RS_PIN);
-    delay_ms(LCD_BUSY_DELAY); //wait until not busy
+    output_high(RW_PIN);
+    
+    output_high(EN_PIN);
+    delay_us(1);
+    b_busy = input(D7_PIN);
+    output_low(EN_PIN);
     
-    output_bit(RS_PIN, DATA_REG); // we are sending data
+    // The second nibble must be clocked out as well
+    delay_us(1);
+    output_high(EN_PIN);
+    delay_us(1);
+    output_low(EN_PIN);
     
-    lcd_send_nibble(data >> 4);
-    lcd_send_nibble(data & 0x0F);
+    // Take the data bus back once the LCD has let go of it
+    output_low(RW_PIN);
+    output_low(D4_PIN);
+    output_low(D5_PIN);
+    output_low(D6_PIN);
+    output_low(D7_PIN);
+    return b_busy;
 }
 
-// Writes to the command register on the LCD
-void lcd_send_command(int8 data)
+// Fills a frame buffer with one character
+void lcd_frame_fill(char * frame, char c)
 {
-    output_low(RS_PIN);
-    delay_ms(LCD_BUSY_DELAY); //wait until not busy
+    int i;
     
-    output_bit(RS_PIN, COMMAND_REG); // we are sending a command
+    for (i = 0 ; i < (LCD_ROWS * LCD_COLUMNS) ; i++)
+    {
+        frame[i] = c;
+    }
+}
+
+// Adds an entry to the queue, dropped if the queue is full
+void lcd_queue_put(unsigned int16 entry)
+{
+    unsigned int8 next = (g_lcd_tail + 1) % LCD_QUEUE_LENGTH;
+    
+    if (next != g_lcd_head)
+    {
+        g_lcd_queue[g_lcd_tail] = entry;
+        g_lcd_tail = next;
+    }
+}
+
+// Queues a write to the data register on the LCD
+void lcd_send_data(int8 data)
+{
+    lcd_queue_put(LCD_ENTRY_DATA | data);
+}
+
+// Queues a write to the command register on the LCD
+void lcd_send_command(int8 data)
+{
+    lcd_queue_put(data);
+}
+
+// Returns 1 while queued entries have not been sent yet
+int1 lcd_busy(void)
+{
+    return (g_lcd_head != g_lcd_tail);
+}
+
+// Sends the queued entries the LCD is ready for, called every millisecond
+void lcd_service(void)
+{
+    unsigned int16 entry;
+    int8 data;
+    int i;
     
-    lcd_send_nibble(data >> 4);
-    lcd_send_nibble(data & 0x0F);
+    for (i = 0 ; (i < LCD_BYTES_PER_CALL) && (g_lcd_head != g_lcd_tail) ; i++)
+    {
+        // Previous entry still executing
+        if (timebase_elapsed(g_lcd_sent_ticks) < g_lcd_hold_ticks)
+        {
+            return;
+        }
+        
+        entry = g_lcd_queue[g_lcd_head];
+
+#if LCD_USE_BUSY_FLAG
+        if (((entry & (LCD_ENTRY_DELAY | LCD_ENTRY_NO_BUSY)) == 0) && (lcd_read_busy() == true))
+        {
+            if (gb_lcd_waiting == false)
+            {
+                gb_lcd_waiting = true;
+                g_lcd_busy_since_ms = timebase_ms();
+            }
+            else if ((timebase_ms() - g_lcd_busy_since_ms) >= LCD_BUSY_TIMEOUT_MS)
+            {
+                // LCD unplugged or stuck, drop what is queued
+                // What the display shows is unknown now, so the next flush
+                // rewrites every character
+                g_lcd_head = g_lcd_tail;
+                gb_lcd_waiting = false;
+                lcd_frame_fill(&g_lcd_shown[0][0], LCD_SHOWN_UNKNOWN);
+            }
+            return;
+        }
+        gb_lcd_waiting = false;
+#endif
+        
+        g_lcd_head = (g_lcd_head + 1) % LCD_QUEUE_LENGTH;
+        g_lcd_sent_ticks = timebase_ticks();
+        data = entry & 0xFF;
+        
+        if (entry & LCD_ENTRY_DELAY)
+        {
+            g_lcd_hold_ticks = TIMEBASE_US_TO_TICKS((int32)data * 1000);
+            continue;
+        }
+        
+        output_bit(RS_PIN, !!(entry & LCD_ENTRY_DATA));
+        lcd_send_nibble(data >> 4);
+        lcd_send_nibble(data & 0x0F);
+
+#if LCD_USE_BUSY_FLAG
+        if ((entry & LCD_ENTRY_NO_BUSY) == 0)
+        {
+            g_lcd_hold_ticks = 0;
+            continue;
+        }
+#endif
+        if (((entry & LCD_ENTRY_DATA) == 0) && (data <= 0x03))
+        {
+            g_lcd_hold_ticks = TIMEBASE_US_TO_TICKS(LCD_CLEAR_US);
+        }
+        else
+        {
+            g_lcd_hold_ticks = TIMEBASE_US_TO_TICKS(LCD_COMMAND_US);
+        }
+    }
 }
 
-// Initializes the LCD for 4 bit communication
+// Queues the initialization of the LCD for 4 bit communication
+// Anything still queued from before is dropped
 void lcd_init(void)
 {
+    g_lcd_head = g_lcd_tail;
+    gb_lcd_waiting = false;
+    
+    // The display is cleared below
+    lcd_frame_fill(&g_lcd_shown[0][0], ' ');
+    
     // lcd reset sequence (http://www.8051projects.net/lcd-interfacing/lcd-4-bit.php)
+    // The busy flag cannot be read until the interface is in 4 bit mode
     output_low(RS_PIN);
-    delay_ms(20);
-    lcd_send_command(0x30);
-    delay_ms(10);
-    lcd_send_command(0x30);
-    delay_ms(1);
-    lcd_send_command(0x30);
-    delay_ms(1);
-    lcd_send_command(0x20);
-    delay_ms(1);
+    lcd_queue_put(LCD_ENTRY_DELAY | 20);
+    lcd_queue_put(LCD_ENTRY_NO_BUSY | 0x30);
+    lcd_queue_put(LCD_ENTRY_DELAY | 10);
+    lcd_queue_put(LCD_ENTRY_NO_BUSY | 0x30);
+    lcd_queue_put(LCD_ENTRY_DELAY | 1);
+    lcd_queue_put(LCD_ENTRY_NO_BUSY | 0x30);
+    lcd_queue_put(LCD_ENTRY_DELAY | 1);
+    lcd_queue_put(LCD_ENTRY_NO_BUSY | 0x20);
+    lcd_queue_put(LCD_ENTRY_DELAY | 1);
     
     // lcd initialization
     lcd_send_command(0x28); // 4 bit interface, 2 lines, 5x7 resolution
@@ -108,5 +286,57 @@ void lcd_write(char * str)
     }
 }
 
-#endif
+// Clears the frame buffer
+void lcd_frame_clear(void)
+{
+    lcd_frame_fill(&g_lcd_frame[0][0], ' ');
+}
+
+// Writes a string to the frame buffer, cut off at the end of the row
+void lcd_frame_write(int8 row, int8 column, char * str)
+{
+    while ((*str != 0) && (column < LCD_COLUMNS))
+    {
+        g_lcd_frame[row][column] = *str;
+        str++;
+        column++;
+    }
+}
 
+// Queues the characters of the frame buffer that differ from the display
+// Waits until the previous flush has drained so the shadow copy stays exact
+void lcd_frame_flush(void)
+{
+    int8 row;
+    int8 column;
+    int1 b_at_cursor; // Cursor already sits at this column
+    
+    if (lcd_busy() == true)
+    {
+        return;
+    }
+    
+    for (row = 0 ; row < LCD_ROWS ; row++)
+    {
+        b_at_cursor = false;
+        for (column = 0 ; column < LCD_COLUMNS ; column++)
+        {
+            if (g_lcd_frame[row][column] != g_lcd_shown[row][column])
+            {
+                if (b_at_cursor == false)
+                {
+                    lcd_set_cursor_position(row, column);
+                    b_at_cursor = true;
+                }
+                lcd_send_data(g_lcd_frame[row][column]);
+                g_lcd_shown[row][column] = g_lcd_frame[row][column];
+            }
+            else
+            {
+                b_at_cursor = false;
+            }
+        }
+    }
+}
+
+#endif
@@ -2,10 +2,16 @@
 #define LTC6804_C
 
 #include "pec.c"
+#include "filter.c"
+#include "timebase.c"
+#include "debounce.c"
+#include "spi_link.c"
 
 // LTC6804 datasheet: http://cds.linear.com/docs/en/datasheet/680412fb.pdf
 
-// LTC6804 spi commands, 11 bits each
+// LTC6804 spi commands, 11 bits each, and the PEC of each command
+// The command PECs never change, so they are precomputed (pec15 of the two
+// command bytes) and a command is sent as a ready made 4 byte frame
 #define WRCFG   0x0001 // Write configuration register group
 #define RDCFG   0x0002 // Read configuration register group
 #define RDCVA   0x0004 // Read cell voltage register group A (cells 1-3)
@@ -24,7 +30,70 @@
 #define WRCOMM  0x0721 // Write COMM register group
 #define RDCOMM  0x0722 // Read COMM register group
 #define STCOMM  0x0723 // Start I2C/SPI communication
-#define ADCV    0x0370 // Datasheet page 53
+#define ADCV    0x0260 // Datasheet page 53, MD = 00, DCP = 0, CH = 000 (all cells)
+#define ADCV_DCP 0x0010 // Discharge permitted during the conversion
+#define ADSTAT_ITMP 0x056A // Datasheet page 55, MD = 10 (7kHz), CHST = 010 (die temperature only)
+
+#define WRCFG_PEC   0x3D6E
+#define RDCFG_PEC   0x2B0A
+#define RDCVA_PEC   0x07C2
+#define RDCVB_PEC   0x9A94
+#define RDCVC_PEC   0x5E52
+#define RDCVD_PEC   0xC304
+#define RDAUXA_PEC  0xEFCC
+#define RDAUXB_PEC  0x729A
+#define RDSTATA_PEC 0xED72
+#define RDSTATB_PEC 0x7024
+#define CLRCELL_PEC 0xC9C0
+#define CLRAUX_PEC  0xDFA4
+#define CLRSTAT_PEC 0x5496
+#define PLADC_PEC   0xF36C
+#define DIAGN_PEC   0x785E
+#define WRCOMM_PEC  0x24B2
+#define RDCOMM_PEC  0x32D6
+#define STCOMM_PEC  0xB9E4
+#define ADSTAT_ITMP_PEC 0xA6F8
+
+// Sends one of the constant commands above as a prebuilt frame
+#define LTC6804_SEND_COMMAND(cmd) ltc6804_write_command(cmd, cmd##_PEC)
+
+// ADCV command for a given ADC mode, discharge permitted or not
+#define ADCV_CMD(mode)        (ADCV | (((int16)(mode)) << 7) | ADCV_DCP)
+#define ADCV_CMD_NO_DCP(mode) (ADCV | (((int16)(mode)) << 7))
+
+// LTC6804 ADC modes (MD bits) with ADCOPT = 0, datasheet table 1
+typedef enum
+{
+    LTC6804_MODE_FAST     = 1, // 27kHz, 1.113ms to convert all cells
+    LTC6804_MODE_NORMAL   = 2, // 7kHz, 2.335ms to convert all cells
+    LTC6804_MODE_FILTERED = 3, // 26Hz, 201.317ms to convert all cells
+} ltc6804_mode_t;
+
+// Conversion times of each ADC mode in microseconds, indexed by MD
+static unsigned int32 g_ltc6804_conversion_time_us[4] = {0, 1113, 2335, 201317};
+
+// PEC of ADCV_CMD(mode) and ADCV_CMD_NO_DCP(mode), indexed by MD
+const unsigned int16 g_adcv_pec[4]        = {0x0000, 0x6328, 0xAF42, 0xEB64};
+const unsigned int16 g_adcv_no_dcp_pec[4] = {0x0000, 0x3806, 0xF46C, 0xB04A};
+
+// Measurement windows while cells are bleeding
+// Bleed current through the sense wires pulls the reading of a bleeding cell
+// down. Every LTC6804_WINDOW_PERIOD-th conversion while any cell bleeds is
+// started with DCP = 0, which pauses the bleeding during the conversion. The
+// other conversions keep bleeding, and with LTC6804_IR_COMPENSATION set the
+// reading of each bleeding cell is raised by an IR drop learned per cell from
+// the difference to its last window reading.
+// Load current sags every reading too, so the drop is only learned while the
+// pack current is close to zero, see ltc6804_set_ir_learning(). The raised
+// reading only goes into balance_voltage, the protection checks use voltage,
+// the reading as measured, and b_bled tells them which readings were pulled
+// down by bleeding.
+#define LTC6804_WINDOW_PERIOD   4
+#ifndef LTC6804_IR_COMPENSATION
+#define LTC6804_IR_COMPENSATION 1
+#endif
+#define LTC6804_IR_DROP_MAX   500 // Largest believable IR drop, 50mV
+#define LTC6804_IR_DROP_SHIFT   3 // Learning rate, 1/8 of the error per reading
 
 // LTC6804 configuration bytes (bytes 4 and 5 used for charging/discharging)
 #define CFGR0   0x00   // VREFON = 1, ADCOPT = 0
@@ -32,50 +101,212 @@
 #define CFGR2   0x06   // Overvoltage lower nibble + undervoltage upper nibble
 #define CFGR3   0xA4   // Overvoltage  = 4.20V (0xA40)
 
+// Discharge timer (DCTO, upper nibble of CFGR5) armed whenever a discharge
+// bit is set. The firmware ends each balancing period itself, the timer only
+// stops the bleeding if the firmware never writes the configuration again.
+#define LTC6804_DCTO 0x1 // 0.5 minutes
+
 // Number of channels on the LTC6804, and number of channels being used
 #define N_CELLS 30     // The 3 LTC devices will monitor 30 cells
+#define N_LTC6804 3
+
+// Longest time to poll for a cell voltage conversion to complete
+// The fast and normal modes are polled right after the other reads, so this
+// covers the full 2.335ms of the 7kHz mode plus margin. The filtered mode is
+// only polled once its conversion time has passed.
+#define LTC6804_CONVERSION_TIMEOUT_US 3000
+
+// Modes slower than this are collected on a later pass instead of waited for
+#define LTC6804_MAX_BLOCKING_US 5000
 
 // Number of samples for moving average
 #define N_VOLTAGE_SAMPLES 10
 
+#define EXPAND_AS_CHIP_CS_ARRAY(a,b)          a,
+#define EXPAND_AS_CHIP_MUX_ARRAY(a,b)         b,
+#define EXPAND_AS_GROUP_CHIP_ARRAY(a,b,c,d)   a,
+#define EXPAND_AS_GROUP_CMD_ARRAY(a,b,c,d)    b,
+#define EXPAND_AS_GROUP_FIRST_ARRAY(a,b,c,d)  c,
+#define EXPAND_AS_GROUP_CELLS_ARRAY(a,b,c,d)  d,
+#define EXPAND_AS_GROUP_PEC_ARRAY(a,b,c,d)    b##_PEC,
+
+// X macro table of LTC6804 chips
 // Unintuitive, but the mux is actually configured in this way according
 // to the schmatic:
 //
-// LTC_1: S[1:0] = 10 
+// LTC_1: S[1:0] = 10
 // LTC_2: S[1:0] = 01
 // LTC_3: S[1:0] = 00
 //
-#define SELECT_LTC_1        \
-    output_low(MISO_SEL0);  \
-    output_high(MISO_SEL1);
+//        Chip select, MISO mux S[1:0]
+#define LTC6804_CHIP_TABLE(ENTRY) \
+    ENTRY(CSBI1      , 0x02)      \
+    ENTRY(CSBI2      , 0x01)      \
+    ENTRY(CSBI3      , 0x00)
+
+// X macro table of cell voltage register groups, read in this order
+// Each group holds 3 cells. Bit n of the populated mask is set if cell
+// (first cell + n) is connected. Groups with no populated cells are skipped.
+//        Chip, Group, First cell, Populated mask
+#define LTC6804_GROUP_TABLE(ENTRY) \
+    ENTRY(0   , RDCVA,  0, 0x07) \
+    ENTRY(0   , RDCVB,  3, 0x07) \
+    ENTRY(0   , RDCVC,  6, 0x07) \
+    ENTRY(0   , RDCVD,  9, 0x07) \
+    ENTRY(1   , RDCVA, 12, 0x07) \
+    ENTRY(1   , RDCVB, 15, 0x07) \
+    ENTRY(1   , RDCVC, 18, 0x07) \
+    ENTRY(1   , RDCVD, 21, 0x07) \
+    ENTRY(2   , RDCVA, 24, 0x07) \
+    ENTRY(2   , RDCVB, 27, 0x07) \
+    ENTRY(2   , RDCVC, 30, 0x00) \
+    ENTRY(2   , RDCVD, 33, 0x00)
+#define N_CELL_GROUPS 12
+
+// Number of cells in a cell voltage register group
+#define CELLS_PER_GROUP 3
+
+// A register group is 6 data bytes followed by a 2 byte PEC
+// It is read with one transaction: the 4 byte command frame, then the group
+#define GROUP_DATA_BYTES 6
+#define GROUP_BYTES      8
+#define COMMAND_BYTES    4
+#define GROUP_TXN_BYTES  (COMMAND_BYTES+GROUP_BYTES)
+
+// Number of times a register group with a bad PEC is read again
+#define LTC6804_MAX_RETRIES 2
+
+const int16 g_chip_cs[N_LTC6804] =
+{
+    LTC6804_CHIP_TABLE(EXPAND_AS_CHIP_CS_ARRAY)
+};
+
+const unsigned int8 g_chip_mux[N_LTC6804] =
+{
+    LTC6804_CHIP_TABLE(EXPAND_AS_CHIP_MUX_ARRAY)
+};
+
+const unsigned int8 g_group_chip[N_CELL_GROUPS] =
+{
+    LTC6804_GROUP_TABLE(EXPAND_AS_GROUP_CHIP_ARRAY)
+};
 
-#define SELECT_LTC_2        \
-    output_high(MISO_SEL0); \
-    output_low(MISO_SEL1);
+const unsigned int16 g_group_cmd[N_CELL_GROUPS] =
+{
+    LTC6804_GROUP_TABLE(EXPAND_AS_GROUP_CMD_ARRAY)
+};
+
+const unsigned int16 g_group_pec[N_CELL_GROUPS] =
+{
+    LTC6804_GROUP_TABLE(EXPAND_AS_GROUP_PEC_ARRAY)
+};
 
-#define SELECT_LTC_3        \
-    output_low(MISO_SEL0);  \
-    output_low(MISO_SEL1);
+const unsigned int8 g_group_first[N_CELL_GROUPS] =
+{
+    LTC6804_GROUP_TABLE(EXPAND_AS_GROUP_FIRST_ARRAY)
+};
+
+const unsigned int8 g_group_cells[N_CELL_GROUPS] =
+{
+    LTC6804_GROUP_TABLE(EXPAND_AS_GROUP_CELLS_ARRAY)
+};
 
 static int16 g_discharge1;
 static int16 g_discharge2;
 static int16 g_discharge3;
 
+// ADC mode used for the next conversion, and for the one in progress
+static ltc6804_mode_t g_ltc6804_mode;
+static ltc6804_mode_t g_conversion_mode;
+
+// Set while a cell voltage conversion is running and has not been read back
+static int1 gb_conversion_pending;
+
+// Discharge bits of each LTC6804 that stayed on during the conversion in
+// progress, all clear for a measurement window
+static int16 g_conversion_bleed[N_LTC6804];
+
+// Conversions since the last measurement window
+static unsigned int8 g_window_count;
+
+// Set while the conversion in progress is a measurement window
+static int1 gb_conversion_window;
+
+// Set while the pack current is low enough for the IR drop to be learned
+static int1 gb_ir_learning = false;
+
+// Time at which the last cell voltage conversion was started
+static unsigned int32 g_conversion_start_ms;
+
+// Timebase tick at which polling for the conversion began
+static unsigned int16 g_poll_start;
+
+// Number of conversions each LTC6804 failed to complete within the timeout
+static unsigned int16 g_ltc6804_pladc_faults[N_LTC6804];
+
+// Number of register group reads from each LTC6804 that failed the PEC check
+static unsigned int16 g_ltc6804_pec_errors[N_LTC6804];
+
+// Internal die temperature of each LTC6804 in 0.1 degC
+static signed int16 g_ltc6804_die_temp[N_LTC6804];
+
+// Command frame and received bytes of each register group transaction
+static unsigned int8 g_group_frame[N_CELL_GROUPS][COMMAND_BYTES];
+static unsigned int8 g_group_rx[N_CELL_GROUPS][GROUP_TXN_BYTES];
+
+// Bit g is set by the DMA interrupt once register group g has been received
+static unsigned int16 g_group_ready;
+
+// Bit g is set while register group g has not passed its PEC check
+static unsigned int16 g_group_failed;
+
+// Reads in a row that register group g failed, retries included
+static unsigned int16 g_group_fail_run[N_CELL_GROUPS];
+
 // Struct for a cell
 typedef struct
 {
-    unsigned int16 voltage; // LTC6804 has a 16 bit voltage ADC
-    unsigned int16 average_voltage;
+    unsigned int16 voltage; // LTC6804 has a 16 bit voltage ADC, as measured
+    unsigned int16 balance_voltage; // Reading with the learned IR drop added back
+    unsigned int16 average_voltage; // Average of balance_voltage
     unsigned int16 samples[N_VOLTAGE_SAMPLES];
-    unsigned int16 ov_count;
-    unsigned int16 uv_count;
+    filter_t       filter;
+    debounce_t     ov;      // Over voltage debounce
+    debounce_t     uv;      // Under voltage debounce
+    unsigned int16 rest_voltage; // Last non bleeding reading at low current, 0 if none
+    unsigned int16 ir_drop;      // Learned reading drop while bleeding, 0.1mV
+    int1           b_bled;       // Last reading was taken while the cell bled
 } cell_t;
 
+// Cells that the register group transactions in flight are written to
+static cell_t * gp_cell_dest;
+
 // Function prototypes
 void ltc6804_wakeup(void);
-void ltc6804_write_command(unsigned int16);
-void ltc6804_write_config(int16,int16);
+void ltc6804_write_command(unsigned int16,unsigned int16);
+void ltc6804_write_config(int16);
+void ltc6804_write_discharge(void);
+void ltc6804_select(unsigned int8);
 void ltc6804_init(void);
+void ltc6804_set_mode(ltc6804_mode_t);
+void ltc6804_set_ir_learning(int1);
+unsigned int32 ltc6804_conversion_time_us(ltc6804_mode_t);
+void ltc6804_send_cell_conversion(void);
+void ltc6804_start_cell_conversion(void);
+void ltc6804_restart_cell_conversion(void);
+int1 ltc6804_cell_conversion_pending(void);
+int1 ltc6804_cell_conversion_due(void);
+int1 ltc6804_poll_conversion(int16);
+void ltc6804_wait_cell_conversion(void);
+void ltc6804_read_die_temperatures(void);
+void ltc6804_store_cell(cell_t *, unsigned int16, int1);
+void ltc6804_group_done(unsigned int8);
+void ltc6804_store_groups(void);
+void ltc6804_wait_groups(void);
+unsigned int16 ltc6804_group_fail_run(unsigned int8);
+void ltc6804_submit_group(unsigned int8);
+void ltc6804_start_read_cell_voltages(cell_t *);
+void ltc6804_finish_read_cell_voltages(void);
 void ltc6804_read_cell_voltages(cell_t *);
 
 void ltc6804_wakeup(void)
@@ -94,21 +325,17 @@ void ltc6804_wakeup(void)
     output_low(CSBI3);
 }
 
-// Sends an 11 bit (2 bytes) command to LTC-1
-void ltc6804_write_command(unsigned int16 command)
+// Sends an 11 bit (2 bytes) command and its precomputed PEC
+void ltc6804_write_command(unsigned int16 command, unsigned int16 crc)
 {
-    char bytes[2];
-    unsigned int16 crc;
-    bytes[0] = (command&(0xFF00))>>8;
-    bytes[1] = command&(0x00FF);
-    crc = pec15(bytes,2);
     spi_write((command&(0xFF00))>>8);
     spi_write(command&(0x00FF));
     spi_write((crc&0xFF00)>>8);
     spi_write(crc&0x00FF);
 }
 
-// Sends two bytes of config data to LTC-1
+// Sends the configuration with 12 discharge bits to the selected LTC6804
+// The discharge timer is armed along with any discharge bit
 void ltc6804_write_config(int16 data)
 {
     char bytes[6];
@@ -118,29 +345,28 @@ void ltc6804_write_config(int16 data)
     bytes[2] = CFGR2;
     bytes[3] = CFGR3;
     bytes[4] = data&0x00FF;
-    bytes[5] = (data&0xFF00)>>8;
+    bytes[5] = (data&0x0F00)>>8;
+    if ((data&0x0FFF) != 0)
+    {
+        bytes[5] |= LTC6804_DCTO << 4;
+    }
     crc = pec15(bytes,6);
-
-    ltc6804_write_command(WRCFG);
-    spi_write(CFGR0);
-    spi_write(CFGR1);
-    spi_write(CFGR2);
-    spi_write(CFGR3);
-    spi_write(data&0x00FF);
-    spi_write((data&0xFF00)>>8);
+    
+    LTC6804_SEND_COMMAND(WRCFG);
+    spi_write(bytes[0]);
+    spi_write(bytes[1]);
+    spi_write(bytes[2]);
+    spi_write(bytes[3]);
+    spi_write(bytes[4]);
+    spi_write(bytes[5]);
     spi_write((crc&0xFF00)>>8);
     spi_write(crc&0x00FF);
 }
 
-// Sends configuration bytes to LTC-1 and LTC-2
-void ltc6804_init(void)
+// Writes g_discharge1, g_discharge2 and g_discharge3 to LTC-1, LTC-2 and LTC-3
+// Uses the blocking SPI calls, SPI1 must be idle
+void ltc6804_write_discharge(void)
 {
-    g_discharge1 = 0x0000;
-    g_discharge2 = 0x0000;
-    g_discharge3 = 0x0000;
-    
-    init_PEC15_Table();
-    ltc6804_wakeup();
     output_low(CSBI1);
     ltc6804_write_config(g_discharge1);
     output_high(CSBI1);
@@ -152,159 +378,475 @@ void ltc6804_init(void)
     output_high(CSBI3);
 }
 
-// Receives a pointer to an array of cells, writes the cell voltage to each one
-void ltc6804_read_cell_voltages(cell_t * cell)
+// Routes the SDO line of one LTC6804 to the MISO pin through the mux
+void ltc6804_select(unsigned int8 chip)
+{
+    output_bit(MISO_SEL0, bit_test(g_chip_mux[chip], 0));
+    output_bit(MISO_SEL1, bit_test(g_chip_mux[chip], 1));
+}
+
+// Sends configuration bytes to LTC-1 and LTC-2
+void ltc6804_init(void)
 {
     int i;
-    int msb;
-    int lsb;
     
-    // Start the cell voltage adc conversion
+    g_discharge1 = 0x0000;
+    g_discharge2 = 0x0000;
+    g_discharge3 = 0x0000;
+    
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        g_ltc6804_pladc_faults[i] = 0;
+        g_ltc6804_pec_errors[i]   = 0;
+        g_ltc6804_die_temp[i]     = 0;
+    }
+    
+    // Build the command frame of every register group once
+    for (i = 0 ; i < N_CELL_GROUPS ; i++)
+    {
+        g_group_frame[i][0] = (g_group_cmd[i]&0xFF00)>>8;
+        g_group_frame[i][1] = g_group_cmd[i]&0x00FF;
+        g_group_frame[i][2] = (g_group_pec[i]&0xFF00)>>8;
+        g_group_frame[i][3] = g_group_pec[i]&0x00FF;
+        g_group_fail_run[i] = 0;
+    }
+    
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        g_conversion_bleed[i] = 0;
+    }
+    g_window_count = 0;
+    
+    g_ltc6804_mode = LTC6804_MODE_NORMAL;
+    g_conversion_mode = LTC6804_MODE_NORMAL;
+    gb_conversion_pending = false;
+    gb_conversion_window = false;
+    
+    ltc6804_wakeup();
     output_low(CSBI1);
-    ltc6804_write_command(ADCV);
+    ltc6804_write_config(g_discharge1);
     output_high(CSBI1);
     output_low(CSBI2);
-    ltc6804_write_command(ADCV);
+    ltc6804_write_config(g_discharge2);
     output_high(CSBI2);
     output_low(CSBI3);
-    ltc6804_write_command(ADCV);
+    ltc6804_write_config(g_discharge3);
     output_high(CSBI3);
+}
+
+// Selects the ADC mode used from the next cell voltage conversion onwards
+// A pending conversion is switched over by ltc6804_restart_cell_conversion()
+void ltc6804_set_mode(ltc6804_mode_t mode)
+{
+    g_ltc6804_mode = mode;
+}
+
+// Allows the IR drop to be learned, only while the pack current is close to zero
+void ltc6804_set_ir_learning(int1 b_learning)
+{
+    gb_ir_learning = b_learning;
+}
+
+// Returns the time a cell voltage conversion takes in the given mode
+unsigned int32 ltc6804_conversion_time_us(ltc6804_mode_t mode)
+{
+    return g_ltc6804_conversion_time_us[mode];
+}
+
+// Sends ADCV in g_conversion_mode to all three LTC6804s, with the discharge
+// permitted unless the conversion is a measurement window
+void ltc6804_send_cell_conversion(void)
+{
+    unsigned int8 chip;
     
-    // Wait 500us for the conversion to complete
-    delay_us(500);
+    for (chip = 0 ; chip < N_LTC6804 ; chip++)
+    {
+        output_low(g_chip_cs[chip]);
+        if (gb_conversion_window == true)
+        {
+            ltc6804_write_command(ADCV_CMD_NO_DCP(g_conversion_mode), g_adcv_no_dcp_pec[g_conversion_mode]);
+        }
+        else
+        {
+            ltc6804_write_command(ADCV_CMD(g_conversion_mode), g_adcv_pec[g_conversion_mode]);
+        }
+        output_high(g_chip_cs[chip]);
+    }
     
-    // Read data for cells 0-2 from LTC-1
-    SELECT_LTC_1;
-    output_low(CSBI1);
-    ltc6804_write_command(RDCVA);
-    for (i = 0 ; i < 3 ; i ++)
+    g_conversion_start_ms = timebase_ms();
+}
+
+// Starts the cell voltage adc conversion on all three LTC6804s
+// The conversion runs in the background, other buses can be used meanwhile
+void ltc6804_start_cell_conversion(void)
+{
+    g_conversion_mode = g_ltc6804_mode;
+    gb_conversion_window = false;
+    
+    // Open a measurement window every few conversions while cells bleed
+    if ((g_discharge1 | g_discharge2 | g_discharge3) != 0)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI1);
+        g_window_count++;
+        if (g_window_count >= LTC6804_WINDOW_PERIOD)
+        {
+            g_window_count = 0;
+            gb_conversion_window = true;
+        }
+    }
     
-    // Read data for cells 3-5 from LTC-1
-    output_low(CSBI1);
-    ltc6804_write_command(RDCVB);
-    for (i = 3 ; i < 6 ; i ++)
+    if (gb_conversion_window == true)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI1);
+        g_conversion_bleed[0] = 0;
+        g_conversion_bleed[1] = 0;
+        g_conversion_bleed[2] = 0;
+    }
+    else
+    {
+        g_conversion_bleed[0] = g_discharge1;
+        g_conversion_bleed[1] = g_discharge2;
+        g_conversion_bleed[2] = g_discharge3;
+    }
     
-    // Read data for cells 6-8 from LTC-1
-    output_low(CSBI1);
-    ltc6804_write_command(RDCVC);
-    for (i = 6 ; i < 9 ; i ++)
+    ltc6804_send_cell_conversion();
+    gb_conversion_pending = true;
+}
+
+// Restarts the pending conversion if the ADC mode has changed since it was
+// started, so a current surge does not wait out a filtered conversion
+// A new ADCV command aborts the conversion in progress. The restart keeps
+// the measurement window and bleed bits of the conversion it replaces.
+void ltc6804_restart_cell_conversion(void)
+{
+    if ((gb_conversion_pending == false) || (g_conversion_mode == g_ltc6804_mode))
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI1);
+        return;
+    }
     
-    // Read data for cells 9-11 from LTC-1
-    output_low(CSBI1);
-    ltc6804_write_command(RDCVD);
-    for (i = 9 ; i < 12 ; i ++)
+    g_conversion_mode = g_ltc6804_mode;
+    ltc6804_send_cell_conversion();
+}
+
+// Returns 1 if a conversion has been started and not read back yet
+int1 ltc6804_cell_conversion_pending(void)
+{
+    return gb_conversion_pending;
+}
+
+// Returns 1 if the pending conversion should be collected now
+// Short conversions are always collected (the PLADC poll absorbs the rest of
+// the conversion time), long ones only once their conversion time has passed
+int1 ltc6804_cell_conversion_due(void)
+{
+    unsigned int32 time_us = ltc6804_conversion_time_us(g_conversion_mode);
+    
+    if (time_us <= LTC6804_MAX_BLOCKING_US)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI1);
+        return true;
+    }
+    else
+    {
+        return ((timebase_ms() - g_conversion_start_ms)*1000 >= time_us);
+    }
+}
+
+// Sends PLADC to one LTC6804 and clocks SDO until the conversion completes
+// The MISO mux must already select the chip. Returns 0 on timeout.
+// SDO is read at least once, so a chip that completed while an earlier chip
+// used up the shared timeout is not counted as a fault too.
+int1 ltc6804_poll_conversion(int16 cs_pin)
+{
+    int1 b_done = false;
     
-    // Read data for cells 12-14 from LTC-2
-    SELECT_LTC_2;
-    output_low(CSBI2);
-    ltc6804_write_command(RDCVA);
-    for (i = 12 ; i < 15 ; i ++)
+    output_low(cs_pin);
+    LTC6804_SEND_COMMAND(PLADC);
+    do
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI2);
+        // SDO is held low until the conversion is complete
+        if (spi_read(0xFF) != 0x00)
+        {
+            b_done = true;
+        }
+    } while ((b_done == false)
+        && (timebase_elapsed(g_poll_start) < TIMEBASE_US_TO_TICKS(LTC6804_CONVERSION_TIMEOUT_US)));
+    output_high(cs_pin);
     
-    // Read data for cells 15-17 from LTC-2
-    output_low(CSBI2);
-    ltc6804_write_command(RDCVB);
-    for (i = 15 ; i < 18 ; i ++)
+    return b_done;
+}
+
+// Waits until every LTC6804 reports that its cell conversion is complete
+// A chip that times out is counted as a fault and read back anyway
+void ltc6804_wait_cell_conversion(void)
+{
+    unsigned int8 chip;
+    
+    g_poll_start = timebase_ticks();
+    
+    for (chip = 0 ; chip < N_LTC6804 ; chip++)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI2);
+        ltc6804_select(chip);
+        if (ltc6804_poll_conversion(g_chip_cs[chip]) == false)
+        {
+            g_ltc6804_pladc_faults[chip]++;
+        }
+    }
+}
+
+// Measures the internal die temperature of every LTC6804
+// ADSTAT aborts a cell conversion in progress, so this may only run while no
+// cell conversion is pending. Uses the blocking SPI calls, SPI1 must be idle.
+// A chip that times out or fails the PEC check keeps its previous reading.
+void ltc6804_read_die_temperatures(void)
+{
+    unsigned int8 chip;
+    char data[GROUP_BYTES];
+    unsigned int16 itmp;
+    int i;
     
-    // Read data for cells 18-20 from LTC-2
-    output_low(CSBI2);
-    ltc6804_write_command(RDCVC);
-    for (i = 18 ; i < 21 ; i ++)
+    for (chip = 0 ; chip < N_LTC6804 ; chip++)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI2);
+        output_low(g_chip_cs[chip]);
+        LTC6804_SEND_COMMAND(ADSTAT_ITMP);
+        output_high(g_chip_cs[chip]);
+    }
     
-    // Read data for cells 21-23 from LTC-2
-    output_low(CSBI2);
-    ltc6804_write_command(RDCVD);
-    for (i = 21 ; i < 24 ; i ++)
+    g_poll_start = timebase_ticks();
+    
+    for (chip = 0 ; chip < N_LTC6804 ; chip++)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI2);
+        ltc6804_select(chip);
+        if (ltc6804_poll_conversion(g_chip_cs[chip]) == false)
+        {
+            g_ltc6804_pladc_faults[chip]++;
+            continue;
+        }
+        
+        output_low(g_chip_cs[chip]);
+        LTC6804_SEND_COMMAND(RDSTATA);
+        for (i = 0 ; i < GROUP_BYTES ; i++)
+        {
+            data[i] = spi_read(0xFF);
+        }
+        output_high(g_chip_cs[chip]);
+        
+        if (pec15(data, GROUP_DATA_BYTES) == make16(data[6], data[7]))
+        {
+            // ITMP is in 100uV, T = ITMP * 100uV / 7.5mV/degC - 273degC
+            itmp = make16(data[3], data[2]);
+            g_ltc6804_die_temp[chip] = (signed int16)(((int32)itmp * 2) / 15) - 2730;
+        }
+        else
+        {
+            g_ltc6804_pec_errors[chip]++;
+        }
+    }
+}
+
+// Stores one cell reading, compensating it if the cell was bleeding
+// A reading taken with the cell not bleeding becomes its rest voltage. A
+// reading taken while it bled teaches the cell its IR drop.
+void ltc6804_store_cell(cell_t * cell, unsigned int16 reading, int1 b_bleeding)
+{
+    unsigned int16 drop;
     
-    // Read data for cells 24-26 from LTC-3
-    SELECT_LTC_3;
-    output_low(CSBI3);
-    ltc6804_write_command(RDCVA);
-    for (i = 24 ; i < 27 ; i ++)
+    cell->voltage = reading;
+    cell->balance_voltage = reading;
+    cell->b_bled = b_bleeding;
+    
+    if (b_bleeding == false)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI3);
+        // A reading under load is no reference for the bleed drop
+        if (gb_ir_learning == true)
+        {
+            cell->rest_voltage = reading;
+        }
+        else
+        {
+            cell->rest_voltage = 0;
+        }
+        return;
+    }
+
+#if LTC6804_IR_COMPENSATION
+    // Learn only against a rest reading taken at low current, while the
+    // current is still low
+    if ((gb_ir_learning == true) && (cell->rest_voltage != 0))
+    {
+        if (cell->rest_voltage > reading)
+        {
+            drop = cell->rest_voltage - reading;
+            if (drop > LTC6804_IR_DROP_MAX)
+            {
+                drop = LTC6804_IR_DROP_MAX;
+            }
+        }
+        else
+        {
+            drop = 0;
+        }
+        
+        if (drop >= cell->ir_drop)
+        {
+            cell->ir_drop += (drop - cell->ir_drop) >> LTC6804_IR_DROP_SHIFT;
+        }
+        else
+        {
+            cell->ir_drop -= (cell->ir_drop - drop) >> LTC6804_IR_DROP_SHIFT;
+        }
+    }
+    cell->balance_voltage = reading + cell->ir_drop;
+#endif
+}
+
+// Completion callback of a register group transaction, runs in the DMA
+// interrupt and only marks the group received
+void ltc6804_group_done(unsigned int8 g)
+{
+    bit_set(g_group_ready, g);
+}
+
+// Checks the PEC of every received register group and stores the cell
+// voltages of the groups that pass
+void ltc6804_store_groups(void)
+{
+    int i;
+    unsigned int8 g;
+    unsigned int8 cell;
+    unsigned int8 chip;
+    char * data;
     
-    // Read data for cells 27-29 from LTC-3
-    output_low(CSBI3);
-    ltc6804_write_command(RDCVB);
-    for (i = 27 ; i < 30 ; i ++)
+    for (g = 0 ; g < N_CELL_GROUPS ; g++)
     {
-        lsb = spi_read(0xFF);
-        msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
-    }    
-    spi_read(0xFF); // PEC1
-    spi_read(0xFF); // PEC2
-    output_high(CSBI3);
+        if (bit_test(g_group_ready, g) == 0)
+        {
+            continue;
+        }
+        bit_clear(g_group_ready, g);
+        
+        chip = g_group_chip[g];
+        data = &g_group_rx[g][COMMAND_BYTES];
+        if (pec15(data, GROUP_DATA_BYTES) == make16(data[6], data[7]))
+        {
+            for (i = 0 ; i < CELLS_PER_GROUP ; i++)
+            {
+                if (bit_test(g_group_cells[g], i))
+                {
+                    cell = g_group_first[g] + i;
+                    ltc6804_store_cell(&gp_cell_dest[cell], make16(data[2*i+1], data[2*i]),
+                                       bit_test(g_conversion_bleed[chip], cell - (12*chip)));
+                }
+            }
+            bit_clear(g_group_failed, g);
+        }
+        else
+        {
+            g_ltc6804_pec_errors[chip]++;
+            bit_set(g_group_failed, g);
+        }
+    }
+}
+
+// Queues the transaction that reads one register group on SPI1
+void ltc6804_submit_group(unsigned int8 g)
+{
+    spi_txn_t txn;
+    unsigned int8 chip = g_group_chip[g];
+    
+    txn.cs_pin    = g_chip_cs[chip];
+    txn.mux       = g_chip_mux[chip];
+    txn.length    = GROUP_TXN_BYTES;
+    txn.tx_length = COMMAND_BYTES;
+    txn.tx        = g_group_frame[g];
+    txn.rx        = g_group_rx[g];
+    txn.callback  = ltc6804_group_done;
+    txn.tag       = g;
+    spi_dma_submit(SPI_BUS_LTC, &txn);
+}
+
+// Waits for the register group reads in flight and stores the groups that
+// arrived. Groups lost to a bus timeout stay failed.
+void ltc6804_wait_groups(void)
+{
+    if (spi_dma_wait(SPI_BUS_LTC) == false)
+    {
+        spi_link_timeout(SPI_BUS_LTC);
+    }
+    ltc6804_store_groups();
+}
+
+// Queues the reads of every populated register group and returns
+// ltc6804_wait_cell_conversion() must be called first
+void ltc6804_start_read_cell_voltages(cell_t * cell)
+{
+    unsigned int8 g;
+    
+    gb_conversion_pending = false;
+    gp_cell_dest = cell;
+    g_group_ready = 0;
+    g_group_failed = 0;
+    
+    // A group counts as failed until its PEC check passes
+    for (g = 0 ; g < N_CELL_GROUPS ; g++)
+    {
+        if (g_group_cells[g] != 0)
+        {
+            bit_set(g_group_failed, g);
+            ltc6804_submit_group(g);
+        }
+    }
+}
+
+// Waits for the register group reads to complete, then checks and stores
+// them outside the DMA interrupt
+// A group that fails its PEC check is read again, up to LTC6804_MAX_RETRIES
+// times. If it never passes, its cells keep their previous voltages and the
+// read counts towards its fail run, which the protection task trips on.
+// PEC errors on the first pass slow SPI1 down before the retries.
+void ltc6804_finish_read_cell_voltages(void)
+{
+    unsigned int8 g;
+    int retries;
+    
+    ltc6804_wait_groups();
+    spi_link_report(SPI_BUS_LTC, g_group_failed != 0);
+    
+    for (retries = 0 ; (g_group_failed != 0) && (retries < LTC6804_MAX_RETRIES) ; retries++)
+    {
+        for (g = 0 ; g < N_CELL_GROUPS ; g++)
+        {
+            if (bit_test(g_group_failed, g))
+            {
+                ltc6804_submit_group(g);
+            }
+        }
+        ltc6804_wait_groups();
+    }
+    
+    for (g = 0 ; g < N_CELL_GROUPS ; g++)
+    {
+        if (bit_test(g_group_failed, g) == 0)
+        {
+            g_group_fail_run[g] = 0;
+        }
+        else if (g_group_fail_run[g] < 0xFFFF)
+        {
+            g_group_fail_run[g]++;
+        }
+    }
+}
+
+// Returns the number of reads in a row register group g failed, 0 if its
+// last read passed
+unsigned int16 ltc6804_group_fail_run(unsigned int8 g)
+{
+    return g_group_fail_run[g];
+}
+
+// Receives a pointer to an array of cells, writes the cell voltage to each one
+// ltc6804_wait_cell_conversion() must be called first
+void ltc6804_read_cell_voltages(cell_t * cell)
+{
+    ltc6804_start_read_cell_voltages(cell);
+    ltc6804_finish_read_cell_voltages();
 }
 
 #endif
@@ -10,11 +10,19 @@
 #include "stdlib.h"
 #include "math.h"
 #include "pec.c"
+#include "filter.c"
+#include "timebase.c"
+#include "scheduler.c"
+#include "events.c"
 #include "ltc6804.c"
+#include "balance.c"
 #include "adc.c"
+#include "snapshot.c"
+#include "blackbox.c"
 #include "lcd.c"
 #include "hall_sensor.c"
 #include "eeprom.c"
+#include "fault_log.c"
 #include "can_telem.h"
 #include "can_PIC24.c"
 
@@ -36,21 +44,39 @@
 #define TEMP_CRITICAL             70 // 70C discharge limit
 #define DISCHARGE_LIMIT_AMPS      65 // Current discharge limit (exiting the pack)
 #define CHARGE_LIMIT_AMPS         50 // Current charge limit (entering the pack)
-#define CURRENT_DISCHARGE_LIMIT CURRENT_ZERO+(CURRENT_SLOPE*DISCHARGE_LIMIT_AMPS)
-#define CURRENT_CHARGE_LIMIT    CURRENT_ZERO-(CURRENT_SLOPE*CHARGE_LIMIT_AMPS)
+#define CRITICAL_DISCHARGE_AMPS  130 // Discharge current that opens the Kilovac at once
+#define CRITICAL_CHARGE_AMPS     100 // Charge current that opens the Kilovac at once
+
+// Protection limits in raw ADC codes, so the safety checks never convert units
+// Temperature codes come from thermistor_table.h, which must be regenerated
+// with gen_thermistor_table.py if TEMP_WARNING or TEMP_CRITICAL change
+#define TEMP_WARNING_CODE       THERMISTOR_CODE(TEMP_WARNING)
+#define TEMP_CRITICAL_CODE      THERMISTOR_CODE(TEMP_CRITICAL)
+#define CURRENT_DISCHARGE_LIMIT (CURRENT_ZERO+HALL_AMPS_TO_CODES(DISCHARGE_LIMIT_AMPS))
+#define CURRENT_CHARGE_LIMIT    (CURRENT_ZERO-HALL_AMPS_TO_CODES(CHARGE_LIMIT_AMPS))
+#define CURRENT_CRITICAL_DISCHARGE (CURRENT_ZERO+HALL_AMPS_TO_CODES(CRITICAL_DISCHARGE_AMPS))
+#define CURRENT_CRITICAL_CHARGE    (CURRENT_ZERO-HALL_AMPS_TO_CODES(CRITICAL_CHARGE_AMPS))
 
 // Delay periods
 #define HEARTBEAT_PERIOD_MS      500 // Status LED blink period
 #define TELEMETRY_PERIOD_MS      200 // Telemetry data sending period
-#define BALANCE_PERIOD_MS       2000 // Balancing discharge period
 #define PMS_RESPONSE_TIMEOUT_MS 1000 // Timeout period for PMS response
-#define BALANCING_TIMEOUT_MS     500 // Timeout period for the balancing command
 #define MPPT_DELAY_MS            100 // MPPT turn off time
 #define BLINKER_WAIT_TIME_MS     100 // Time the blinker needs to process the trip signal
+#define DIE_TEMP_PERIOD_MS      1000 // LTC6804 die temperature measurement period
+#define DISPLAY_REFRESH_MS       250 // LCD dashboard redraw period
+#define DISPLAY_PAGE_MS         3000 // Time each LCD dashboard page is shown
+#define N_DISPLAY_PAGES            3
+
+// Task periods
+#define PROTECT_PERIOD_MS         10 // Sensor acquisition and protection checks
+#define BALANCE_TASK_PERIOD_MS    10 // Balancing state updates
 
-// Misc defines
-#define BALANCE_THRESHOLD        500 // Voltage threshold for balancing to occur (BALANCE_THRESHOLD / 10) mV
-#define N_BAD_SAMPLES             30 // Number of bad data samples required to trip
+// LTC6804 ADC mode selection
+#define MODE_VOLTAGE_MARGIN     1000 // Fast mode within 100 mV of VOLTAGE_MAX or VOLTAGE_MIN
+#define MODE_FAST_CURRENT_AMPS    20 // Fast mode at or above this pack current
+#define MODE_REST_CURRENT_AMPS     2 // Filtered mode below this pack current
+#define IR_LEARN_CURRENT_AMPS      1 // Bleed IR drop learned below this pack current
 
 // CAN bus defines
 #define TX_PRI 3
@@ -61,6 +87,44 @@
 #define CAN_SEND_DATA_PACKET(i) \
     can_putd(g_can_id[i],gp_can_data_address[i],g_can_len[i],TX_PRI,TX_EXT,TX_RTR)
 
+// X macro table of scheduled tasks
+// Tasks that are due at the same time run top to bottom
+//       Task name       , Function        , Period (ms)
+#define TASK_TABLE(ENTRY)                                               \
+    ENTRY(TASK_ACQUIRE   , acquire_task    , PROTECT_PERIOD_MS)         \
+    ENTRY(TASK_PROTECT   , protect_task    , PROTECT_PERIOD_MS)         \
+    ENTRY(TASK_BALANCE   , balance_task    , BALANCE_TASK_PERIOD_MS)    \
+    ENTRY(TASK_TELEMETRY , telemetry_task  , TELEMETRY_PERIOD_MS)       \
+    ENTRY(TASK_DISPLAY   , display_task    , LCD_DEBOUNCE_MS)           \
+    ENTRY(TASK_LCD       , lcd_service     , 1)                         \
+    ENTRY(TASK_EEPROM    , eeprom_service  , 1)                         \
+    ENTRY(TASK_FAULTS    , fault_tx_task   , 1)                         \
+    ENTRY(TASK_BLACKBOX  , blackbox_tx_task, 1)
+#define N_TASKS 9
+
+#define EXPAND_AS_TASK_ENUM(a,b,c)  a,
+#define EXPAND_AS_TASK_ARRAY(a,b,c) {b, c, 0, 0},
+
+enum {TASK_TABLE(EXPAND_AS_TASK_ENUM)};
+
+// X macro table of events posted by interrupt handlers
+// Pending events are handled top to bottom by the main loop
+//       Event name      , Handler
+#define EVENT_TABLE(ENTRY)                                              \
+    ENTRY(EVENT_OC_TRIP  , overcurrent_handler)                         \
+    ENTRY(EVENT_TICK     , scheduler_run)                               \
+    ENTRY(EVENT_CAN_RX   , can_rx_handler)
+#define N_EVENTS 3
+
+#define EXPAND_AS_EVENT_ENUM(a,b)     a,
+#define EXPAND_AS_EVENT_DISPATCH(a,b) EVENT_DISPATCH(a,b)
+
+enum {EVENT_TABLE(EXPAND_AS_EVENT_ENUM)};
+
+// Sends a diagnostic packet over CAN bus
+#define CAN_SEND_DIAG_PACKET(i) \
+    can_putd(g_diag_can_id[i],gp_diag_data_address[i],g_diag_can_len[i],TX_PRI,TX_EXT,TX_RTR)
+
 // Creates an array of CAN packet IDs
 static int16 g_can_id[N_CAN_ID] =
 {
@@ -75,6 +139,7 @@ static int16 g_can_len[N_CAN_ID] =
 
 // Telemetry data pages
 TELEM_ID_TABLE(EXPAND_AS_TELEM_PAGE_DECLARATIONS)
+static int8 g_bps_snapshot_page[CAN_BPS_SNAPSHOT_LEN];
 
 // Creates an array of CAN packet addresses
 static int * gp_can_data_address[N_CAN_ID] =
@@ -82,16 +147,53 @@ static int * gp_can_data_address[N_CAN_ID] =
     CAN_ID_TABLE(EXPAND_AS_DATA_ADDRESS_ARRAY)
 };
 
+// Diagnostic packet IDs, lengths, pages and addresses
+static int16 g_diag_can_id[N_CAN_DIAG] =
+{
+    CAN_DIAG_TABLE(EXPAND_AS_CAN_ID_ARRAY)
+};
+
+static int16 g_diag_can_len[N_CAN_DIAG] =
+{
+    CAN_DIAG_TABLE(EXPAND_AS_CAN_LEN_ARRAY)
+};
+
+CAN_DIAG_TABLE(EXPAND_AS_TELEM_PAGE_DECLARATIONS)
+
+static int * gp_diag_data_address[N_CAN_DIAG] =
+{
+    CAN_DIAG_TABLE(EXPAND_AS_DATA_ADDRESS_ARRAY)
+};
+
 static cell_t         g_cell[N_CELLS];
 static temperature_t  g_temperature[N_ADC_CHANNELS];
 static current_t      g_current;
+static debounce_t     g_ltc_link[N_CELL_GROUPS]; // Register group failing every read
+static debounce_t     g_adc_link;                // Thermistor sweep failing every read
 static int1           gb_connected;
+static int1           gb_cells_fresh;
 static int1           gb_balance_enable;
+static unsigned int32 g_balance_start_ms; // Start of the current balancing period
+static unsigned int32 g_die_temp_ms;      // Time of the last die temperature measurement
+static unsigned int32 g_state_deadline_ms; // Timeout of the current state
+static int1           gb_trip_signalled;   // Trip signal sent, waiting for the blinker
+static unsigned int32 g_protect_last_ms;   // Start of the previous protection pass
+static unsigned int16 g_protect_interval_ms;     // Time between the last two protection passes
+static unsigned int16 g_protect_max_interval_ms; // Longest time between protection passes
 static int1           gb_pms_response_received;
 static int1           gb_motor_connected;
 static int1           gb_mppt_connected;
 static bps_state_t    g_state;
 static unsigned int8  g_errors[N_ERROR_BYTES];
+static acq_timing_t   g_acq_timing;
+static snapshot_t     g_tx_snapshot; // Snapshot the current telemetry cycle is sent from
+static snapshot_t     g_display_snapshot; // Snapshot the LCD dashboard is drawn from
+static int1           gb_fault_readout = false; // Fault history requested over CAN
+static unsigned int8  g_fault_readout_frame;    // Next fault history frame to send
+static int1           gb_blackbox_readout = false; // Black box requested over CAN
+static int1           gb_blackbox_thaw;            // Resume recording after the readout
+static unsigned int8  g_blackbox_readout_frame;    // Black box frame being sent
+static unsigned int8  g_blackbox_readout_value;    // First value of the next packet
 
 // Initializes voltage and temperature error counts, current, and other flags
 void main_init(void)
@@ -102,50 +204,58 @@ void main_init(void)
     for (i = 0 ; i < N_CELLS ; i++)
     {
         g_cell[i].average_voltage  = 0;
-        g_cell[i].ov_count         = 0;
-        g_cell[i].uv_count         = 0;
+        filter_init(&g_cell[i].filter, g_cell[i].samples, N_VOLTAGE_SAMPLES);
+        debounce_init(&g_cell[i].ov);
+        debounce_init(&g_cell[i].uv);
+        g_cell[i].balance_voltage  = 0;
+        g_cell[i].rest_voltage     = 0;
+        g_cell[i].ir_drop          = 0;
+        g_cell[i].b_bled           = false;
     }
     
     // Resets average temperatures and error counts
     for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
         g_temperature[i].average  = 0;
-        g_temperature[i].ot_count = 0;
-        g_temperature[i].wt_count = 0;
+        filter_init(&g_temperature[i].filter, g_temperature[i].samples, N_TEMPERATURE_SAMPLES);
+        debounce_init(&g_temperature[i].ot);
+        debounce_init(&g_temperature[i].wt);
     }
     
     // Resets average current and error counts
     g_current.average  = 0;
-    g_current.oc_count = 0;
-    g_current.uc_count = 0;
+    filter_init(&g_current.filter, g_current.samples, N_CURRENT_SAMPLES);
+    debounce_init(&g_current.oc);
+    debounce_init(&g_current.uc);
+    
+    // Resets the sensor link debounces
+    for (i = 0 ; i < N_CELL_GROUPS ; i++)
+    {
+        debounce_init(&g_ltc_link[i]);
+    }
+    debounce_init(&g_adc_link);
     
     gb_connected = false;
+    gb_trip_signalled = false;
+    g_protect_interval_ms = 0;
+    g_protect_max_interval_ms = 0;
     g_state = SAFETY_CHECK;
 }
 
-// Returns the index for the lowest voltage cell
-int get_lowest_voltage_cell_index(void)
+// Returns the temperature of the hottest thermistor in 0.1 degC
+signed int16 get_board_temperature(void)
 {
     int i;
-    int lowest = 0;
-    for (i = 0 ; i < N_CELLS ; i++)
+    int hottest = 0;
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
-        if (g_cell[i].voltage <= g_cell[lowest].voltage)
+        // NTC thermistors, the hottest one reads the lowest code
+        if (g_temperature[i].average < g_temperature[hottest].average)
         {
-            lowest = i;
+            hottest = i;
         }
     }
-    return lowest;
-}
-
-// Use the simplified Steinhart-Hart equation to approximate temperatures
-void convert_adc_data_to_temps(void)
-{
-    int i;
-    for (i = 0; i < N_ADC_CHANNELS; i++)
-    {
-        g_temperature[i].converted = thermistor_convert_data(g_temperature[i].average);
-    }
+    return thermistor_convert_data(g_temperature[hottest].average);
 }
 
 void disable_balancing(void)
@@ -153,88 +263,52 @@ void disable_balancing(void)
     g_discharge1 = 0x000;
     g_discharge2 = 0x000;
     g_discharge3 = 0x000;
-    output_low(CSBI1);
-    ltc6804_write_config(g_discharge1);
-    output_high(CSBI1);
-    output_low(CSBI2);
-    ltc6804_write_config(g_discharge2);
-    output_high(CSBI2);
-    output_low(CSBI3);
-    ltc6804_write_config(g_discharge3);
-    output_high(CSBI3);
+    ltc6804_write_discharge();
 }
 
 void average_voltage(void)
 {
     int i;
-    int j;
-    unsigned int32 sum;
     for (i = 0 ; i < N_CELLS ; i++)
     {
-        sum = 0;
-        for (j = 0 ; j < N_VOLTAGE_SAMPLES-1 ; j++)
-        {
-            sum += g_cell[i].samples[j];
-            g_cell[i].samples[j] = g_cell[i].samples[j+1];
-        }
-        sum += g_cell[i].voltage;
-        g_cell[i].samples[N_VOLTAGE_SAMPLES-1] = g_cell[i].voltage;
-        g_cell[i].average_voltage = (unsigned int16) (sum/N_VOLTAGE_SAMPLES);
+        g_cell[i].average_voltage = filter_update(&g_cell[i].filter, g_cell[i].balance_voltage);
     }
 }
 
 void average_temperature(void)
 {
     int i;
-    int j;
-    unsigned int32 sum;
     for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
-        sum = 0;
-        for (j = 0 ; j < N_TEMPERATURE_SAMPLES-1 ; j++)
-        {
-            sum += g_temperature[i].samples[j];
-            g_temperature[i].samples[j] = g_temperature[i].samples[j+1];
-        }
-        sum += g_temperature[i].raw;
-        g_temperature[i].samples[N_TEMPERATURE_SAMPLES-1] = g_temperature[i].raw;
-        g_temperature[i].average = (unsigned int16) (sum/N_TEMPERATURE_SAMPLES);
+        g_temperature[i].average = filter_update(&g_temperature[i].filter, g_temperature[i].raw);
     }
 }
 
 void average_current(void)
 {
-    int i;
-    unsigned int32 sum = 0;
-    for (i = 0 ; i < N_CURRENT_SAMPLES-1 ; i++)
-    {
-        sum += g_current.samples[i];
-        g_current.samples[i] = g_current.samples[i+1];
-    }
-    sum += g_current.raw;
-    g_current.samples[N_CURRENT_SAMPLES-1] = g_current.raw;
-    g_current.average = (unsigned int16) (sum/N_CURRENT_SAMPLES);
+    g_current.average = filter_update(&g_current.filter, g_current.raw);
 }
 
-void update_voltage_data(void)
+void update_voltage_data(snapshot_t * snapshot)
 {
     int i;
     for (i = 0 ; i < N_CELLS ; i++)
     {
-        g_bps_voltage_page[i]   = (int8)(g_cell[i].average_voltage >> 8);
+        g_bps_voltage_page[i]   = (int8)(snapshot->voltage[i] >> 8);
     }
 }
 
-void update_temperature_data(void)
+void update_temperature_data(snapshot_t * snapshot)
 {
     int i;
+    // Temperatures are only converted to degC for telemetry
     for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
-        g_bps_temperature_page[i] = (unsigned int8) (g_temperature[i].converted);
+        g_bps_temperature_page[i] = (unsigned int8) (thermistor_convert_data(snapshot->temperature[i])/10);
     }
 }
 
-void update_cur_bal_stat_data(void)
+void update_cur_bal_stat_data(snapshot_t * snapshot)
 {
     // Current, balancing bits, and pack status are stored in the same CAN packet and telemetry page
     
@@ -242,64 +316,309 @@ void update_cur_bal_stat_data(void)
     static int1 b_heartbeat = 0;
     
     // Update current data
-    g_bps_cur_bal_stat_page[0] = (int8) ((g_current.average>>8)&0xFF);
-    g_bps_cur_bal_stat_page[1] = (int8) (g_current.average&0xFF);
+    g_bps_cur_bal_stat_page[0] = (int8) ((snapshot->current>>8)&0xFF);
+    g_bps_cur_bal_stat_page[1] = (int8) (snapshot->current&0xFF);
     
     // Update balancing bits
-    int32 discharge = ((((int32)(g_discharge1))<< 0)&0x00000FFF)
-                     |((((int32)(g_discharge2))<<12)&0x00FFF000)
-                     |((((int32)(g_discharge3))<<24)&0x3F000000);
+    int32 discharge = ((((int32)(snapshot->discharge[0]))<< 0)&0x00000FFF)
+                     |((((int32)(snapshot->discharge[1]))<<12)&0x00FFF000)
+                     |((((int32)(snapshot->discharge[2]))<<24)&0x3F000000);
     g_bps_cur_bal_stat_page[2] = (int8) (((int32)(discharge>> 24))&0xFF);
     g_bps_cur_bal_stat_page[3] = (int8) (((int32)(discharge>> 16))&0xFF);
     g_bps_cur_bal_stat_page[4] = (int8) (((int32)(discharge>>  8))&0xFF);
     g_bps_cur_bal_stat_page[5] = (int8) (((int32)(discharge>>  0))&0xFF);
     
     // Update the pack status
-    g_bps_cur_bal_stat_page[6] = gb_connected;
+    g_bps_cur_bal_stat_page[6] = snapshot->b_connected;
     
     // Update CAN heartbeat bit
     g_bps_cur_bal_stat_page[7] = b_heartbeat;
     b_heartbeat = !b_heartbeat;
 }
 
-int1 check_voltage(void)
+// Writes a 16 bit value to a telemetry page, MSB first
+void put_page_int16(int8 * page, unsigned int16 value)
 {
+    page[0] = (int8) ((value>>8)&0xFF);
+    page[1] = (int8) (value&0xFF);
+}
+
+void update_snapshot_data(snapshot_t * snapshot)
+{
+    // Sequence number and timestamp in ms of the scan the packets that
+    // follow in this telemetry cycle were taken from
+    put_page_int16(g_bps_snapshot_page+0, snapshot->seq);
+    put_page_int16(g_bps_snapshot_page+2, snapshot->timestamp_ms >> 16);
+    put_page_int16(g_bps_snapshot_page+4, snapshot->timestamp_ms & 0xFFFF);
+    g_bps_snapshot_page[6] = 0;
+    g_bps_snapshot_page[7] = 0;
+}
+
+void update_acq_timing_data(void)
+{
+    // Stage durations of the last acquisition in microseconds
+    put_page_int16(g_bps_acq_timing_page+0, TIMEBASE_TICKS_TO_US(g_acq_timing.total));
+    put_page_int16(g_bps_acq_timing_page+2, TIMEBASE_TICKS_TO_US(g_acq_timing.thermistors));
+    put_page_int16(g_bps_acq_timing_page+4, TIMEBASE_TICKS_TO_US(g_acq_timing.wait));
+    put_page_int16(g_bps_acq_timing_page+6, TIMEBASE_TICKS_TO_US(g_acq_timing.cells));
+}
+
+void update_ltc_errors_data(void)
+{
+    unsigned int16 pladc_faults = 0;
     int i;
     
-    // Read the cell voltages, compute a moving average of each cell voltage
-    ltc6804_read_cell_voltages(g_cell);
-    average_voltage();
+    // PEC errors of each LTC6804, then PLADC timeouts of all three
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        put_page_int16(g_bps_ltc_errors_page+(2*i), g_ltc6804_pec_errors[i]);
+        pladc_faults += g_ltc6804_pladc_faults[i];
+    }
+    put_page_int16(g_bps_ltc_errors_page+6, pladc_faults);
+}
+
+// Updates the SPI link speed of both buses
+void update_spi_link_data(void)
+{
+    unsigned int8 timeouts_ltc = spi_link_timeouts(SPI_BUS_LTC);
+    unsigned int8 timeouts_adc = spi_link_timeouts(SPI_BUS_ADC);
     
-    for (i = 0 ; i < N_CELLS ; i++)
+    if (timeouts_ltc > 0x0F)
     {
-        if (g_cell[i].voltage >= VOLTAGE_MAX)
-        {
-            // Voltage is too high, increment the OV count
-            g_cell[i].ov_count++;
-        }
-        else if (g_cell[i].voltage <= VOLTAGE_MIN)
+        timeouts_ltc = 0x0F;
+    }
+    if (timeouts_adc > 0x0F)
+    {
+        timeouts_adc = 0x0F;
+    }
+    
+    // Speed level of SPI1 and SPI2 with their timeouts (up to 15) in the high
+    // nibble, then their clocks in kHz and backoffs
+    g_bps_spi_link_page[0] = (timeouts_ltc<<4) | spi_link_level(SPI_BUS_LTC);
+    g_bps_spi_link_page[1] = (timeouts_adc<<4) | spi_link_level(SPI_BUS_ADC);
+    put_page_int16(g_bps_spi_link_page+2, spi_link_khz(SPI_BUS_LTC));
+    put_page_int16(g_bps_spi_link_page+4, spi_link_khz(SPI_BUS_ADC));
+    g_bps_spi_link_page[6] = spi_link_backoffs(SPI_BUS_LTC);
+    g_bps_spi_link_page[7] = spi_link_backoffs(SPI_BUS_ADC);
+}
+
+// Updates the balancing planner state
+void update_balance_data(void)
+{
+    unsigned int32 eta_s = g_balance.eta_ms / 1000;
+    
+    // State, cells bleeding, lowest cell, current slot, largest voltage
+    // difference in 0.1mV and estimated time to balanced in seconds
+    g_bps_balance_page[0] = g_balance.state;
+    g_bps_balance_page[1] = g_balance.n_active;
+    g_bps_balance_page[2] = g_balance.lowest;
+    g_bps_balance_page[3] = g_balance.slot;
+    put_page_int16(g_bps_balance_page+4, g_balance.max_delta);
+    if (eta_s > 0xFFFF)
+    {
+        eta_s = 0xFFFF;
+    }
+    put_page_int16(g_bps_balance_page+6, eta_s);
+}
+
+// Updates the LTC6804 die temperatures and bleed caps
+void update_thermal_data(void)
+{
+    int i;
+    
+    // Die temperature of each LTC6804 in 0.1 degC, then the bleed caps
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        put_page_int16(g_bps_thermal_page+(2*i), g_ltc6804_die_temp[i]);
+    }
+    g_bps_thermal_page[6] = (g_balance_cap[1]<<4) | g_balance_cap[0];
+    g_bps_thermal_page[7] = g_balance_cap[2];
+}
+
+// Updates the worst case execution time of each task and the protection rate
+void update_task_data(void)
+{
+    // Worst case execution times of acquire, protect, balance and telemetry
+    // in microseconds
+    put_page_int16(g_bps_task_wcet_page+0, scheduler_wcet_us(TASK_ACQUIRE));
+    put_page_int16(g_bps_task_wcet_page+2, scheduler_wcet_us(TASK_PROTECT));
+    put_page_int16(g_bps_task_wcet_page+4, scheduler_wcet_us(TASK_BALANCE));
+    put_page_int16(g_bps_task_wcet_page+6, scheduler_wcet_us(TASK_TELEMETRY));
+    
+    // Display worst case in microseconds, then the last and longest time
+    // between protection passes in milliseconds, then the state and the
+    // number of eeprom writes that timed out
+    put_page_int16(g_bps_task_stats_page+0, scheduler_wcet_us(TASK_DISPLAY));
+    put_page_int16(g_bps_task_stats_page+2, g_protect_interval_ms);
+    put_page_int16(g_bps_task_stats_page+4, g_protect_max_interval_ms);
+    g_bps_task_stats_page[6] = g_state;
+    g_bps_task_stats_page[7] = eeprom_failures();
+}
+
+// Reads every sensor once and updates the moving averages
+// The thermistors and the pack current are read while the LTC6804s convert
+// Cell voltages are only read back once their conversion is due, in the
+// filtered ADC mode that takes several passes. A pending conversion is
+// started again if the ADC mode changed since it began. gb_cells_fresh is
+// set when new cell voltages were read on this pass.
+void acquire_data(void)
+{
+    unsigned int16 t_begin;
+    unsigned int16 t_stage;
+    unsigned int16 t_now;
+    
+    t_begin = timebase_ticks();
+    if (ltc6804_cell_conversion_pending() == false)
+    {
+        ltc6804_start_cell_conversion();
+    }
+    else
+    {
+        // A conversion started in another ADC mode is started again
+        ltc6804_restart_cell_conversion();
+    }
+    t_now = timebase_ticks();
+    g_acq_timing.start = t_now - t_begin;
+    
+    // The thermistor frames run on SPI2 in the background while the current
+    // is sampled and the cell voltages are read on SPI1
+    ads7952_start_read_all_channels(g_temperature);
+    
+    t_stage = t_now;
+    g_current.raw = hall_sensor_read_data();
+    average_current();
+    t_now = timebase_ticks();
+    g_acq_timing.current = t_now - t_stage;
+    
+    g_acq_timing.wait  = 0;
+    g_acq_timing.cells = 0;
+    gb_cells_fresh = false;
+    if (ltc6804_cell_conversion_due() == true)
+    {
+        t_stage = t_now;
+        ltc6804_wait_cell_conversion();
+        t_now = timebase_ticks();
+        g_acq_timing.wait = t_now - t_stage;
+        
+        t_stage = t_now;
+        ltc6804_start_read_cell_voltages(g_cell);
+        gb_cells_fresh = true;
+    }
+    
+    // Time spent waiting for the thermistor frames still in flight
+    t_now = timebase_ticks();
+    if (ads7952_finish_read_all_channels() == true)
+    {
+        average_temperature();
+    }
+    g_acq_timing.thermistors = timebase_elapsed(t_now);
+    
+    if (gb_cells_fresh == true)
+    {
+        ltc6804_finish_read_cell_voltages();
+        average_voltage();
+        t_now = timebase_ticks();
+        g_acq_timing.cells = t_now - t_stage;
+        
+        // No cell conversion is pending until the next pass starts one
+        if ((timebase_ms() - g_die_temp_ms) >= DIE_TEMP_PERIOD_MS)
         {
-            // Voltage is too low, increment the UV count
-            g_cell[i].uv_count++;
+            ltc6804_read_die_temperatures();
+            g_die_temp_ms = timebase_ms();
+            t_now = timebase_ticks();
         }
-        else
+    }
+    
+    t_now = timebase_ticks();
+    g_acq_timing.total = t_now - t_begin;
+}
+
+// Returns the distance of the averaged pack current from zero, in codes
+unsigned int16 pack_current_offset(void)
+{
+    if (g_current.average >= CURRENT_ZERO)
+    {
+        return g_current.average - CURRENT_ZERO;
+    }
+    return CURRENT_ZERO - g_current.average;
+}
+
+// Picks the LTC6804 ADC mode for the next conversion
+// Fast mode when a cell is near a voltage limit or the pack current is high,
+// so trips are detected sooner. Filtered mode at rest, where the hardware
+// filter does the noise rejection. Normal mode otherwise.
+ltc6804_mode_t select_adc_mode(void)
+{
+    int i;
+    unsigned int16 current_offset = pack_current_offset();
+    
+    if (current_offset >= HALL_AMPS_TO_CODES(MODE_FAST_CURRENT_AMPS))
+    {
+        return LTC6804_MODE_FAST;
+    }
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        if ((g_cell[i].voltage >= (VOLTAGE_MAX - MODE_VOLTAGE_MARGIN))
+         || (g_cell[i].voltage <= (VOLTAGE_MIN + MODE_VOLTAGE_MARGIN)))
         {
-            // Voltage is within the safe operating range, clear OV and UV counts
-            g_cell[i].ov_count = 0;
-            g_cell[i].uv_count = 0;
+            return LTC6804_MODE_FAST;
         }
-        
-        if (g_cell[i].ov_count >= N_BAD_SAMPLES)
+    }
+    
+    if (current_offset < HALL_AMPS_TO_CODES(MODE_REST_CURRENT_AMPS))
+    {
+        return LTC6804_MODE_FILTERED;
+    }
+    else
+    {
+        return LTC6804_MODE_NORMAL;
+    }
+}
+
+// Returns 1 while a cell is over voltage, updating its debounce
+// A reading taken while the cell bled is low by up to the bleed IR drop, so
+// it cannot clear the debounce. It only counts if the reading is over the
+// limit with the learned drop added back, otherwise the debounce is held
+// until the next measurement window.
+int1 check_cell_ov(cell_t * cell)
+{
+    if (cell->b_bled == false)
+    {
+        return debounce_update(&cell->ov, cell->voltage >= VOLTAGE_MAX, OV_DEBOUNCE_MS);
+    }
+    else if ((cell->voltage + cell->ir_drop) >= VOLTAGE_MAX)
+    {
+        return debounce_update(&cell->ov, true, OV_DEBOUNCE_MS);
+    }
+    return cell->ov.b_tripped;
+}
+
+int1 check_voltage(void)
+{
+    int i;
+    
+    if (gb_cells_fresh == false)
+    {
+        // No new cell voltages this pass, nothing new to check
+        return 1;
+    }
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        if (check_cell_ov(&g_cell[i]) == true)
         {
-            // Too many OV errors, write OV error to eeprom and return false
+            // Voltage too high for too long, write OV error to eeprom and return false
             eeprom_set_ov_error(i);
+            fault_log_note(FAULT_OV, i, g_cell[i].voltage);
             output_high(STATUS);
             return 0;
         }
-        else if (g_cell[i].uv_count >= N_BAD_SAMPLES)
+        else if (debounce_update(&g_cell[i].uv, g_cell[i].voltage <= VOLTAGE_MIN, UV_DEBOUNCE_MS) == true)
         {
-            // Too many UV errors, write UV error to eeprom and return false
+            // Voltage too low for too long, write UV error to eeprom and return false
             eeprom_set_uv_error(i);
+            fault_log_note(FAULT_UV, i, g_cell[i].voltage);
             output_high(STATUS);
             return 0;
         }
@@ -313,47 +632,58 @@ int1 check_voltage(void)
     return 1;
 }
 
+// Checks that every sensor is still being read
+// A register group or thermistor sweep that keeps failing leaves its
+// readings at their last values, which the checks would go on trusting
+int1 check_links(void)
+{
+    unsigned int8 g;
+    
+    for (g = 0 ; g < N_CELL_GROUPS ; g++)
+    {
+        if (debounce_update(&g_ltc_link[g], ltc6804_group_fail_run(g) > 0, LINK_DEBOUNCE_MS) == true)
+        {
+            // Cell voltages lost for too long, return false
+            fault_log_note(FAULT_LTC_LINK, g, ltc6804_group_fail_run(g));
+            output_high(STATUS);
+            return 0;
+        }
+    }
+    
+    if (debounce_update(&g_adc_link, ads7952_fail_run() > 0, LINK_DEBOUNCE_MS) == true)
+    {
+        // Thermistors lost for too long, return false
+        fault_log_note(FAULT_ADC_LINK, 0, ads7952_fail_run());
+        output_high(STATUS);
+        return 0;
+    }
+    
+    // Every sensor was read, return true
+    return 1;
+}
+
 int1 check_temperature(void)
 {
     int i;
     
-    // Find highest temperature reading
-    ads7952_read_all_channels(g_temperature);
-    average_temperature();
-    convert_adc_data_to_temps();
-    
+    // Thermistors are NTC, a hotter cell gives a lower ADC code
     for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
-        if (g_temperature[i].converted >= TEMP_CRITICAL)
-        {
-            // Temperature is critical, increment the OT count
-            g_temperature[i].ot_count++;
-        }
-        else if (g_temperature[i].converted >= TEMP_WARNING)
-        {
-            // Temperature is above the warning threshold, increment the WT count
-            g_temperature[i].wt_count++;
-        }
-        else
+        if (debounce_update(&g_temperature[i].ot, g_temperature[i].average <= TEMP_CRITICAL_CODE, OT_DEBOUNCE_MS) == true)
         {
-            // Temperature is within the safe range, clear the error counts
-            g_temperature[i].ot_count = 0;
-            g_temperature[i].wt_count = 0;
-        }
-        
-        if (g_temperature[i].ot_count >= N_BAD_SAMPLES)
-        {
-            // Too many OT errors, write OT error to eeprom and return false
+            // Temperature critical for too long, write OT error to eeprom and return false
             eeprom_set_ot_error(i);
+            fault_log_note(FAULT_OT, i, g_temperature[i].average);
             return 0;
         }
-        else if ((g_temperature[i].wt_count >= N_BAD_SAMPLES) && (g_current.raw <= CURRENT_ZERO))
+        else if ((debounce_update(&g_temperature[i].wt, g_temperature[i].average <= TEMP_WARNING_CODE, WT_DEBOUNCE_MS) == true) && (g_current.raw <= CURRENT_ZERO))
         {
-            // Too many temperature warning errors and the pack is charging
+            // Temperature above the warning threshold for too long and the pack is charging
             // Write OT error to the eeprom and return false
             // PMS will monitor the battery temperatures and disconnect the array
             // when the battery temperature is approaching the warning point
             eeprom_set_ot_error(i);
+            fault_log_note(FAULT_WT, i, g_temperature[i].average);
             return 0;
         }
         else
@@ -368,161 +698,218 @@ int1 check_temperature(void)
 
 int1 check_current(void)
 {
-    // Read the pack current
-    g_current.raw = hall_sensor_read_data();
-    average_current();
-    
-    if (g_current.raw >= CURRENT_DISCHARGE_LIMIT)
+    if (debounce_update(&g_current.oc, g_current.raw >= CURRENT_DISCHARGE_LIMIT, OC_DEBOUNCE_MS) == true)
     {
-        // Current is above the allowed discharge limit
-        g_current.oc_count++;
+        // Current above the discharge limit for too long, write OC error to eeprom, return false
+        eeprom_set_current_error(OC_ERROR);
+        fault_log_note(FAULT_OC, FAULT_CURRENT_DEBOUNCED, g_current.raw);
+        return 0;
     }
-    else if (g_current.raw <= CURRENT_CHARGE_LIMIT)
+    else if (debounce_update(&g_current.uc, g_current.raw <= CURRENT_CHARGE_LIMIT, UC_DEBOUNCE_MS) == true)
     {
-        // Current is below the allowed charge limit
-        g_current.uc_count++;
+        // Current below the charge limit for too long, write UC error to eeprom, return false
+        eeprom_set_current_error(UC_ERROR);
+        fault_log_note(FAULT_UC, FAULT_CURRENT_DEBOUNCED, g_current.raw);
+        return 0;
     }
     else
     {
-        // current is fine
-        g_current.oc_count = 0;
-        g_current.uc_count = 0;
+        // The current is within the safe range, return true
+        return 1;
     }
+}
+
+// Writes a value in tenths as a signed decimal, e.g. -12.3
+void display_tenths(char * str, signed int16 value)
+{
+    char sign = ' ';
     
-    if (g_current.oc_count >= N_BAD_SAMPLES)
+    if (value < 0)
     {
-        // Too many overcurrent errors, write OC error to eeprom, return false
-        eeprom_set_current_error(OC_ERROR);
-        return 0;
+        sign = '-';
+        value = -value;
     }
-    else if (g_current.uc_count >= N_BAD_SAMPLES)
+    sprintf(str, "%c%u.%u", sign, (unsigned int16)value / 10, (unsigned int16)value % 10);
+}
+
+// Draws the highest and lowest cell, their spread, the hottest thermistor
+// and the pack current
+void display_pack_page(snapshot_t * snapshot)
+{
+    char str[24];
+    char value[8];
+    int i;
+    unsigned int16 delta;
+    int highest = 0;
+    int lowest = 0;
+    int hottest = 0;
+    
+    for (i = 1 ; i < N_CELLS ; i++)
     {
-        // Too many undercurrent errors, write UC error to eeprom, return false
-        eeprom_set_current_error(UC_ERROR);
-        return 0;
+        if (snapshot->voltage[i] > snapshot->voltage[highest])
+        {
+            highest = i;
+        }
+        if (snapshot->voltage[i] < snapshot->voltage[lowest])
+        {
+            lowest = i;
+        }
     }
-    else
+    for (i = 1 ; i < N_ADC_CHANNELS ; i++)
     {
-        // The current is within the safe range, return true
-        return 1;
+        // NTC thermistors, the hottest one reads the lowest code
+        if (snapshot->temperature[i] < snapshot->temperature[hottest])
+        {
+            hottest = i;
+        }
+    }
+    
+    sprintf(str, "Vmax %u.%04uV  #%02u", snapshot->voltage[highest] / 10000, snapshot->voltage[highest] % 10000, highest + 1);
+    lcd_frame_write(0, 0, str);
+    sprintf(str, "Vmin %u.%04uV  #%02u", snapshot->voltage[lowest] / 10000, snapshot->voltage[lowest] % 10000, lowest + 1);
+    lcd_frame_write(1, 0, str);
+    
+    delta = snapshot->voltage[highest] - snapshot->voltage[lowest];
+    sprintf(str, "dV   %u.%umV", delta / 10, delta % 10);
+    lcd_frame_write(2, 0, str);
+    
+    display_tenths(value, thermistor_convert_data(snapshot->temperature[hottest]));
+    sprintf(str, "T%sC", value);
+    lcd_frame_write(3, 0, str);
+    display_tenths(value, hall_sensor_deciamps(snapshot->current));
+    sprintf(str, "I%sA", value);
+    lcd_frame_write(3, 10, str);
+}
+
+// Draws the state machine, the balancing plan and the discharge bits
+void display_balance_page(snapshot_t * snapshot)
+{
+    char str[24];
+    
+    lcd_frame_write(0, 0, "BPS");
+    switch(g_state)
+    {
+        case SAFETY_CHECK:
+            lcd_frame_write(0, 5, "SAFETY CHECK");
+            break;
+        case BEGIN_BALANCE:
+        case BALANCING:
+            lcd_frame_write(0, 5, "BALANCING");
+            break;
+        case PMS_RESPONSE_PENDING:
+            lcd_frame_write(0, 5, "PMS PENDING");
+            break;
+        default:
+            lcd_frame_write(0, 5, "DISCONNECT");
+            break;
     }
+    
+    lcd_frame_write(1, 0, "Bal");
+    switch(g_balance.state)
+    {
+        case BALANCE_BLEEDING:
+            lcd_frame_write(1, 5, "BLEEDING");
+            break;
+        case BALANCE_BALANCED:
+            lcd_frame_write(1, 5, "BALANCED");
+            break;
+        default:
+            lcd_frame_write(1, 5, "IDLE");
+            break;
+    }
+    sprintf(str, "%02u/%02u", g_balance.n_active, N_CELLS);
+    lcd_frame_write(1, 15, str);
+    
+    sprintf(str, "Dis  %03X %03X %03X", snapshot->discharge[0], snapshot->discharge[1], snapshot->discharge[2]);
+    lcd_frame_write(2, 0, str);
+    
+    sprintf(str, "Slot %u/%u  ETA %lus", g_balance.slot + 1, N_BALANCE_SLOTS, g_balance.eta_ms / 1000);
+    lcd_frame_write(3, 0, str);
 }
 
-// Reads error data from the eeprom and displays it on the lcd
+// Draws the error data read from the eeprom
 void display_errors(void)
 {
-    char str[3];
+    char str[4]; // Up to "255" and its terminator
     
-    lcd_init();
-    
-    lcd_set_cursor_position(0,0);
-    lcd_write("OV: ");
+    lcd_frame_write(0, 0, "OV: ");
     itoa(g_errors[0],10,str);
-    lcd_write(str);
+    lcd_frame_write(0, 4, str);
     
-    lcd_set_cursor_position(1,0);
-    lcd_write("UV: ");
+    lcd_frame_write(1, 0, "UV: ");
     itoa(g_errors[1],10,str);
-    lcd_write(str);
+    lcd_frame_write(1, 4, str);
     
-    lcd_set_cursor_position(2,0);
-    lcd_write("OT: ");
+    lcd_frame_write(2, 0, "OT: ");
     itoa(g_errors[2],10,str);
-    lcd_write(str);
+    lcd_frame_write(2, 4, str);
     
-    lcd_set_cursor_position(3,0);
-    lcd_write("CURRENT: ");
+    lcd_frame_write(3, 0, "CURRENT: ");
     switch(g_errors[3])
     {
         case OC_ERROR:
-            lcd_write("OC");
+            lcd_frame_write(3, 9, "OC");
             break;
         case UC_ERROR:
-            lcd_write("UC");
+            lcd_frame_write(3, 9, "UC");
             break;
         default:
-            lcd_write("SUCCESS");
+            lcd_frame_write(3, 9, "SUCCESS");
             break;
     }
 }
 
-// Timer 2 blinks heartbeat LED, checks for status of LCD
+// Timer 2 blinks heartbeat LED
 #int_timer2 level = 4
 void isr_timer2(void)
 {
-    static int8 i;
-    static int1 b_lcd_connected = false;
-    
     output_toggle(STATUS);
-    
-    // If the LCD is connected, display errors
-    if ((input_state(LCD_SIG) == 1) && (b_lcd_connected == false))
-    {
-        // LCD connected, debounce the pin
-        for (i = 0 ; i < LCD_DEBOUNCE_MS ; i++)
-        {
-            delay_ms(1);
-        }
-        
-        if (input_state(LCD_SIG) == 1)
-        {
-            // LCD still connected, set flag to true, read and display errors
-            b_lcd_connected = true;
-            display_errors();
-        }
-    }
-    else if (input_state(LCD_SIG) == 0)
-    {
-        // LCD not connected, clear flag
-        b_lcd_connected = false;
-    }
 }
 
-// Timer 4 sends telemetry data over CANbus
+// Timer 4 keeps the millisecond timebase and wakes the scheduler
 #int_timer4 level = 4
 void isr_timer4(void)
 {
-    static int16 ms = 0;
-    static int8  i = 0;
-    
-    if ((ms >= TELEMETRY_PERIOD_MS) && can_tbe())
-    {
-        ms = 0;
-        output_toggle(TX_LED);
-        
-        // Update telemetry data pages
-        update_voltage_data();
-        update_temperature_data();
-        update_cur_bal_stat_data();
-        
-        // Send a packet of CAN data
-        CAN_SEND_DATA_PACKET(i);
-        if (i == (N_CAN_ID-1))
-        {
-            i = 0;
-        }
-        else
-        {
-            i++;
-        }
-    }
-    else
+    timebase_tick_ms();
+    EVENT_POST(EVENT_TICK);
+}
+
+// ADC1 triggers after every hall sensor sample
+// A critical current opens the Kilovac here, the rest of the trip is done
+// by overcurrent_handler() in the main loop
+#int_adc1 level = 6
+void isr_adc1(void)
+{
+    if (hall_sensor_sample(CURRENT_CRITICAL_CHARGE, CURRENT_CRITICAL_DISCHARGE) == true)
     {
-        ms++;
+        output_low(KVAC_PIN);
+        EVENT_POST(EVENT_OC_TRIP);
     }
 }
 
 // C1RX triggers when data is received on the CAN bus
+// The packets are read out by can_rx_handler() in the main loop
 #int_c1rx
 void isr_c1rx(void)
+{
+    EVENT_POST(EVENT_CAN_RX);
+}
+
+// Reads every CAN packet received since the last C1RX interrupt
+void can_rx_handler(void)
 {
     struct rx_stat rxstat;
     int32  rx_id;
     int8   rx_len;
     int8   in_data[8];
     
-    if (can_getd(rx_id, in_data, rx_len, rxstat))
+    while (can_kbhit())
     {
+        if (can_getd(rx_id, in_data, rx_len, rxstat) == false)
+        {
+            break;
+        }
+        
         // Data was received, raise a flag corresponding to the data received
         switch(rx_id)
         {
@@ -542,26 +929,92 @@ void isr_c1rx(void)
             case RESPONSE_MPPT4_ID:
                 gb_mppt_connected = true;
                 break;
+            case COMMAND_BPS_FAULT_HISTORY_ID:
+                g_fault_readout_frame = 0;
+                gb_fault_readout = true;
+                break;
+            case COMMAND_BPS_BLACKBOX_ID:
+                // Hold the frames still while they are sent, a black box
+                // frozen by a trip stays frozen
+                if ((gb_blackbox_readout == false) && (blackbox_frozen() == false))
+                {
+                    blackbox_freeze();
+                    gb_blackbox_thaw = true;
+                }
+                g_blackbox_readout_frame = 0;
+                g_blackbox_readout_value = 0;
+                gb_blackbox_readout = true;
+                break;
             default:
                 break;
         }
     }
 }
 
-void safety_check_state(void)
+// Signals the PMS to disconnect the array and waits for its response
+// The black box keeps the cycles that led up to the trip
+void request_array_disconnect(void)
 {
-    int1 b_success = true;
+    blackbox_freeze();
+    gb_blackbox_thaw = false;
+    can_putd(COMMAND_PMS_DISCONNECT_ARRAY_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
+    g_state_deadline_ms = timebase_ms() + PMS_RESPONSE_TIMEOUT_MS;
+    g_state = PMS_RESPONSE_PENDING;
+}
+
+// Gives the MPPTs time to turn off before the pack is disconnected
+// The faults behind the trip are added to the fault history
+void begin_disconnect_pack(void)
+{
+    fault_log_commit();
+    gb_trip_signalled = false;
+    g_state_deadline_ms = timebase_ms() + MPPT_DELAY_MS;
+    g_state = DISCONNECT_PACK;
+}
+
+// Finishes a trip started by the ADC1 interrupt
+// The fault is recorded from the sample the interrupt latched when it tripped
+// The Kilovac is already open, the trip is recorded and signalled without
+// waiting for the PMS
+void overcurrent_handler(void)
+{
+    unsigned int16 raw = hall_sensor_trip_data();
     
-    b_success &= check_voltage();
-    b_success &= check_temperature();
-    b_success &= check_current();
+    KILOVAC_OFF;
+    if (g_state == DISCONNECT_PACK)
+    {
+        return;
+    }
+    
+    if ((g_state == BEGIN_BALANCE) || (g_state == BALANCING))
+    {
+        disable_balancing();
+        balance_stop();
+    }
     
+    if (hall_sensor_trip_discharge() == true)
+    {
+        eeprom_set_current_error(OC_ERROR);
+        fault_log_note(FAULT_OC, FAULT_CURRENT_CRITICAL, raw);
+    }
+    else
+    {
+        eeprom_set_current_error(UC_ERROR);
+        fault_log_note(FAULT_UC, FAULT_CURRENT_CRITICAL, raw);
+    }
+    blackbox_freeze();
+    gb_blackbox_thaw = false;
+    begin_disconnect_pack();
+}
+
+void safety_check_state(int1 b_success)
+{
     if (b_success == true)
     {
         if (gb_balance_enable == true)
         {
             // All parameters within safe range, balance the cells
-            gb_balance_enable = false;
+            // Balancing continues period after period until the pack is balanced
             g_state = BEGIN_BALANCE;
         }
         else
@@ -574,123 +1027,395 @@ void safety_check_state(void)
     {
         // Something went wrong, signal PMS to disconnect the array
         // Wait for response
-        can_putd(COMMAND_PMS_DISCONNECT_ARRAY_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
-        g_state = PMS_RESPONSE_PENDING;
+        request_array_disconnect();
     }
 }
 
 void begin_balance_state(void)
 {
-    int i;
-    int lowest = get_lowest_voltage_cell_index();
+    // Carry on with or estimate the bleed time of each cell
+    balance_plan(g_cell);
+    if (g_balance.state == BALANCE_BALANCED)
+    {
+        gb_balance_enable = false;
+        g_state = SAFETY_CHECK;
+        return;
+    }
+    
+    balance_govern(get_board_temperature());
+    balance_apply_slot(0);
+    
+    // Enable/disable the discharge pins on the LTC6804
+    // The cells bleed in hardware while the protection task keeps running
+    ltc6804_write_discharge();
+    
+    g_balance_start_ms = timebase_ms();
+    g_state = BALANCING;
+}
+
+void balancing_state(void)
+{
+    unsigned int32 elapsed_ms;
+    unsigned int8  slot;
     
-    for (i = 0 ; i < 12 ; i++)
+    elapsed_ms = timebase_ms() - g_balance_start_ms;
+    if (elapsed_ms >= BALANCE_PERIOD_MS)
     {
-        if ((g_cell[i].average_voltage - g_cell[lowest].average_voltage)
-            > BALANCE_THRESHOLD)
-        {
-            g_discharge1 |= 1 << i;
-        }
-        else
+        // Balancing period over, disable balancing
+        disable_balancing();
+        balance_end();
+        g_state = SAFETY_CHECK;
+    }
+    else
+    {
+        // Continue balancing, the next cells take their turn each slot
+        slot = balance_slot(elapsed_ms);
+        if (slot != g_balance.slot)
         {
-            g_discharge1 &= ~(1 << i);
+            balance_govern(get_board_temperature());
+            balance_apply_slot(slot);
+            ltc6804_write_discharge();
         }
+        g_state = BALANCING;
     }
+}
 
-    for (i = 12 ; i < 24 ; i++)
+void pms_response_pending_state(void)
+{
+    if (gb_pms_response_received == true)
+    {
+        // Response received from PMS, disconnect the pack
+        gb_pms_response_received = false;
+        begin_disconnect_pack();
+    }
+    else if (timebase_deadline_passed(g_state_deadline_ms) == true)
+    {
+        // Response timed out, proceed to disconnect pack
+        begin_disconnect_pack();
+    }
+}
+
+// Signals the trip and opens the Kilovac, then repeats the trip signal
+void disconnect_pack_state(void)
+{
+    if (timebase_deadline_passed(g_state_deadline_ms) == false)
+    {
+        return;
+    }
+    
+    if (gb_trip_signalled == false)
     {
-        if ((g_cell[i].average_voltage - g_cell[lowest].average_voltage)
-            > BALANCE_THRESHOLD)
+        eeprom_write_errors();
+        can_putd(COMMAND_BPS_TRIP_SIGNAL_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
+        gb_trip_signalled = true;
+        g_state_deadline_ms = timebase_ms() + BLINKER_WAIT_TIME_MS; // Wait a bit for the blinker to process the trip signal
+    }
+    else
+    {
+        KILOVAC_OFF;
+        gb_trip_signalled = false;
+        g_state_deadline_ms = timebase_ms() + MPPT_DELAY_MS;
+    }
+}
+
+// Reads every sensor, publishing a snapshot once every sensor has been read
+void acquire_task(void)
+{
+    acquire_data();
+    if (gb_cells_fresh == true)
+    {
+        snapshot_publish(g_cell, g_temperature, g_current.average, gb_connected);
+        blackbox_record(g_cell, g_temperature, g_current.raw);
+    }
+}
+
+// Checks the latest readings against the limits in every state, then runs
+// the states that react to them
+void protect_task(void)
+{
+    int1 b_success = true;
+    unsigned int32 now = timebase_ms();
+    
+    g_protect_interval_ms = now - g_protect_last_ms;
+    if (g_protect_interval_ms > g_protect_max_interval_ms)
+    {
+        g_protect_max_interval_ms = g_protect_interval_ms;
+    }
+    g_protect_last_ms = now;
+    
+    b_success &= check_voltage();
+    b_success &= check_temperature();
+    b_success &= check_current();
+    b_success &= check_links();
+    
+    // Pick the ADC mode for the next cell voltage conversion
+    ltc6804_set_mode(select_adc_mode());
+    
+    // The bleed IR drop is only learned when load current cannot sag the cells
+    ltc6804_set_ir_learning(pack_current_offset() < HALL_AMPS_TO_CODES(IR_LEARN_CURRENT_AMPS));
+    
+    switch(g_state)
+    {
+        case SAFETY_CHECK:
+            safety_check_state(b_success);
+            break;
+        case BEGIN_BALANCE:
+        case BALANCING:
+            if (b_success == false)
+            {
+                // Stop bleeding before asking the PMS to disconnect the array
+                disable_balancing();
+                balance_stop();
+                request_array_disconnect();
+            }
+            break;
+        case PMS_RESPONSE_PENDING:
+            pms_response_pending_state();
+            break;
+        case DISCONNECT_PACK:
+            disconnect_pack_state();
+            break;
+        default:
+            break;
+    }
+}
+
+// Starts and advances balancing periods
+void balance_task(void)
+{
+    switch(g_state)
+    {
+        case BEGIN_BALANCE:
+            begin_balance_state();
+            break;
+        case BALANCING:
+            balancing_state();
+            break;
+        default:
+            break;
+    }
+}
+
+// Sends one telemetry packet over CANbus
+void telemetry_task(void)
+{
+    static int8 i = 0;
+    static int8 diag = 0;
+    static int1 b_diag = false;
+    
+    if (can_tbe() == false)
+    {
+        // Transmit buffers full, try again on the next millisecond
+        scheduler_defer(TASK_TELEMETRY, 1);
+        return;
+    }
+    
+    output_toggle(TX_LED);
+    
+    if ((i == 0) && (b_diag == false))
+    {
+        // Every packet of a telemetry cycle comes from the same snapshot
+        snapshot_read(&g_tx_snapshot);
+        update_snapshot_data(&g_tx_snapshot);
+        update_voltage_data(&g_tx_snapshot);
+        update_temperature_data(&g_tx_snapshot);
+        update_cur_bal_stat_data(&g_tx_snapshot);
+    }
+    
+    if (b_diag == true)
+    {
+        // A full telemetry cycle was sent, follow it with one diagnostic packet
+        update_acq_timing_data();
+        update_ltc_errors_data();
+        update_spi_link_data();
+        update_balance_data();
+        update_thermal_data();
+        update_task_data();
+        CAN_SEND_DIAG_PACKET(diag);
+        b_diag = false;
+        if (diag == (N_CAN_DIAG-1))
         {
-            g_discharge2 |= 1 << (i - 12);
+            diag = 0;
         }
         else
         {
-            g_discharge2 &= ~(1 << (i - 12));
+            diag++;
         }
     }
-    
-    for (i = 24 ; i < 30 ; i++)
+    else
     {
-        if ((g_cell[i].average_voltage - g_cell[lowest].average_voltage)
-            > BALANCE_THRESHOLD)
+        // Send a packet of CAN data
+        CAN_SEND_DATA_PACKET(i);
+        if (i == (N_CAN_ID-1))
         {
-            g_discharge3 |= 1 << (i - 24);
+            i = 0;
+            b_diag = true;
         }
         else
         {
-            g_discharge3 &= ~(1 << (i - 24));
+            i++;
         }
     }
-    
-    // Enable/disable the discharge pins on the LTC6804
-    output_low(CSBI1);
-    ltc6804_write_config(g_discharge1);
-    output_high(CSBI1);
-    output_low(CSBI2);
-    ltc6804_write_config(g_discharge2);
-    output_high(CSBI2);
-    output_low(CSBI3);
-    ltc6804_write_config(g_discharge3);
-    output_high(CSBI3);
-    
-    g_state = BALANCING;
 }
 
-void balancing_state(void)
+// Runs the LCD dashboard once the LCD has been connected for LCD_DEBOUNCE_MS
+// The pages take turns every DISPLAY_PAGE_MS and are redrawn every
+// DISPLAY_REFRESH_MS, only the characters that changed are sent
+void display_task(void)
 {
-    static int16 balance_time_ms = 0;
+    static int1 b_lcd_seen = false;
+    static int1 b_lcd_connected = false;
+    static unsigned int32 connected_ms;
+    static unsigned int32 refresh_ms;
+    unsigned int8 page;
     
-    if (balance_time_ms >= BALANCE_PERIOD_MS)
+    if (input_state(LCD_SIG) == 1)
     {
-        // Balancing period over, disable balancing
-        balance_time_ms = 0;
-        disable_balancing();
-        g_state = SAFETY_CHECK;
+        if ((b_lcd_seen == true) && (b_lcd_connected == false))
+        {
+            // LCD still connected, set flag to true and start the dashboard
+            b_lcd_connected = true;
+            lcd_init();
+            connected_ms = timebase_ms();
+            refresh_ms = connected_ms;
+        }
+        b_lcd_seen = true;
     }
     else
     {
-        // Continue balancing
-        delay_ms(1);
-        balance_time_ms++;
-        g_state = BALANCING;
+        // LCD not connected, clear flags
+        b_lcd_seen = false;
+        b_lcd_connected = false;
+    }
+    
+    if ((b_lcd_connected == false) || (timebase_deadline_passed(refresh_ms) == false))
+    {
+        return;
     }
+    refresh_ms += DISPLAY_REFRESH_MS;
+    
+    page = ((timebase_ms() - connected_ms) / DISPLAY_PAGE_MS) % N_DISPLAY_PAGES;
+    snapshot_read(&g_display_snapshot);
+    lcd_frame_clear();
+    switch(page)
+    {
+        case 0:
+            display_pack_page(&g_display_snapshot);
+            break;
+        case 1:
+            display_balance_page(&g_display_snapshot);
+            break;
+        default:
+            display_errors();
+            break;
+    }
+    lcd_frame_flush();
 }
 
-void pms_response_pending_state(void)
+// Sends the fault history, oldest record first, after a request over CAN
+// Every record takes two packets:
+//   RECORD1: sequence number, trip counter, timestamp in ms
+//   RECORD2: value, fault type, cell or channel, boot counter, position, count
+// An empty history is answered with an empty RECORD1 packet
+void fault_tx_task(void)
 {
-    static int16 timeout_ms = 0;
+    static fault_record_t record;
+    int8 data[8];
+    unsigned int8 n;
     
-    if (timeout_ms >= PMS_RESPONSE_TIMEOUT_MS)
+    if ((gb_fault_readout == false) || (can_tbe() == false))
     {
-        // Response timed out, proceed to disconnect pack
-        g_state = DISCONNECT_PACK;
+        return;
     }
-    else if (gb_pms_response_received == true)
+    
+    n = g_fault_readout_frame / 2;
+    if ((g_fault_readout_frame % 2) == 0)
     {
-        // Response received from PMS, disconnect the pack
-        timeout_ms = 0;
-        gb_pms_response_received = false;
-        g_state = DISCONNECT_PACK;
+        if (fault_log_get(n, &record) == false)
+        {
+            if (n == 0)
+            {
+                can_putd(RESPONSE_BPS_FAULT_RECORD1_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
+            }
+            gb_fault_readout = false;
+            return;
+        }
+        put_page_int16(data+0, record.seq);
+        put_page_int16(data+2, record.trip);
+        put_page_int16(data+4, record.timestamp_ms >> 16);
+        put_page_int16(data+6, record.timestamp_ms);
+        can_putd(RESPONSE_BPS_FAULT_RECORD1_ID,data,8,TX_PRI,TX_EXT,TX_RTR);
     }
     else
     {
-        // No timeout, no CAN packet, increment timeout counter
-        delay_ms(1);
-        timeout_ms++;
-        g_state = PMS_RESPONSE_PENDING;
+        put_page_int16(data+0, record.value);
+        data[2] = record.type;
+        data[3] = record.index;
+        put_page_int16(data+4, record.boot);
+        data[6] = n;
+        data[7] = fault_log_count();
+        can_putd(RESPONSE_BPS_FAULT_RECORD2_ID,data,8,TX_PRI,TX_EXT,TX_RTR);
     }
+    g_fault_readout_frame++;
 }
 
-void disconnect_pack_state(void)
+// Sends the black box after a request over CAN, oldest frame first
+// Every frame takes 19 packets of the frame number, the index of the first
+// value and three values. Values 0-29 are the cell voltages in 0.1mV, 30-53
+// the thermistor codes, 54 the hall sensor code and 55 the low 16 bits of
+// the time in ms. An empty black box is answered with an empty packet
+void blackbox_tx_task(void)
 {
-    delay_ms(MPPT_DELAY_MS);
-    eeprom_write_errors();
-    can_putd(COMMAND_BPS_TRIP_SIGNAL_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
-    delay_ms(BLINKER_WAIT_TIME_MS); // Wait a bit for the blinker to process the trip signal
-    KILOVAC_OFF;
+    static unsigned int16 values[N_BLACKBOX_VALUES];
+    int8 data[8];
+    unsigned int8 k;
+    unsigned int8 v;
+    
+    if ((gb_blackbox_readout == false) || (can_tbe() == false))
+    {
+        return;
+    }
+    
+    if (g_blackbox_readout_value == 0)
+    {
+        if (g_blackbox_readout_frame >= blackbox_count())
+        {
+            if (g_blackbox_readout_frame == 0)
+            {
+                can_putd(RESPONSE_BPS_BLACKBOX_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
+            }
+            if (gb_blackbox_thaw == true)
+            {
+                blackbox_thaw();
+            }
+            gb_blackbox_readout = false;
+            return;
+        }
+        blackbox_decode(g_blackbox_readout_frame, values);
+    }
+    
+    data[0] = g_blackbox_readout_frame;
+    data[1] = g_blackbox_readout_value;
+    for (k = 0 ; k < 3 ; k++)
+    {
+        v = g_blackbox_readout_value + k;
+        put_page_int16(data+2+(2*k), (v < N_BLACKBOX_VALUES) ? values[v] : 0);
+    }
+    can_putd(RESPONSE_BPS_BLACKBOX_ID,data,8,TX_PRI,TX_EXT,TX_RTR);
+    
+    g_blackbox_readout_value += 3;
+    if (g_blackbox_readout_value >= N_BLACKBOX_VALUES)
+    {
+        g_blackbox_readout_value = 0;
+        g_blackbox_readout_frame++;
+    }
 }
 
+static task_t g_tasks[N_TASKS] =
+{
+    TASK_TABLE(EXPAND_AS_TASK_ARRAY)
+};
+
 // Main
 void main()
 {
@@ -699,8 +1424,10 @@ void main()
     // Kilovac is initially disabled
     KILOVAC_OFF;
     
-    // Read back any errors from the eeprom
+    // Load the eeprom shadow and read back any errors
+    eeprom_init();
     eeprom_read(g_errors);
+    fault_log_init();
     
     // Set up and enable timer 2 with a period of HEARTBEAT_PERIOD_MS
     setup_timer2(TMR_INTERNAL|TMR_DIV_BY_256,39*HEARTBEAT_PERIOD_MS);
@@ -714,7 +1441,14 @@ void main()
     enable_interrupts(INT_C1RX);
     
     main_init();
+    timebase_init();
+    spi_dma_init();
+    spi_link_init();
     ltc6804_init();
+    ltc6804_read_die_temperatures();
+    g_die_temp_ms = timebase_ms();
+    balance_init();
+    blackbox_init();
     ads7952_init();
     hall_sensor_init();
     eeprom_clear_flags();
@@ -729,26 +1463,14 @@ void main()
     }
     
     // Populate running averages
-    for (i = 0 ; i < N_VOLTAGE_SAMPLES ; i++)
+    for (i = 0 ; (i < N_VOLTAGE_SAMPLES) || (i < N_TEMPERATURE_SAMPLES) || (i < N_CURRENT_SAMPLES) ; i++)
     {
-        ltc6804_read_cell_voltages(g_cell);
-        average_voltage();
-    }
-    
-    for (i = 0 ; i < N_TEMPERATURE_SAMPLES ; i++)
-    {
-        ads7952_read_all_channels(g_temperature);
-        average_temperature();
-    }
-    
-    for (i = 0 ; i < N_CURRENT_SAMPLES ; i++)
-    {
-        g_current.raw = hall_sensor_read_data();
-        average_current();
+        acquire_data();
     }
     
     // Perform startup test
-    if ((check_voltage() & check_temperature() & check_current()) == true)
+    acquire_data();
+    if (((check_voltage() & check_temperature() & check_current() & check_links()) == true) && (hall_sensor_tripped() == false))
     {
         // Voltage, temperature, and current are all safe
         // Clear the eeprom and connect the pack
@@ -764,28 +1486,15 @@ void main()
         KILOVAC_OFF;
     }
     
+    // Publish the startup readings for the first telemetry cycle
+    snapshot_publish(g_cell, g_temperature, g_current.average, gb_connected);
+    
+    g_protect_last_ms = timebase_ms();
+    scheduler_init(g_tasks, N_TASKS);
     while (true)
     {
-        switch(g_state)
-        {
-            case SAFETY_CHECK:
-                safety_check_state();
-                break;
-            case BEGIN_BALANCE:
-                begin_balance_state();
-                break;
-            case BALANCING:
-                balancing_state();
-                break;
-            case PMS_RESPONSE_PENDING:
-                pms_response_pending_state();
-                break;
-            case DISCONNECT_PACK:
-                disconnect_pack_state();
-                break;
-            default:
-                break;
-        }
+        // Run the handlers of the events the interrupts posted
+        EVENT_TABLE(EXPAND_AS_EVENT_DISPATCH)
     }
 }
 
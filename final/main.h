@@ -28,7 +28,7 @@
 #define ADC2_SEL  PIN_B9  // ADC-2, thermistors 12-23
 
 // I2C port: CAT24AA02
-#use i2c(MASTER, SCL = PIN_G2, SDA = PIN_G3)
+#use i2c(MASTER, FAST = 400000, SCL = PIN_G2, SDA = PIN_G3)
 #define WP_PIN    PIN_A6
 
 // LCD interface (4 bit mode)
@@ -62,3 +62,14 @@ typedef enum
     DISCONNECT_PACK,
     N_STATES
 } bps_state_t;
+
+// Duration of each stage of the last acquisition, in timebase ticks
+typedef struct
+{
+    unsigned int16 start;       // Starting the LTC6804 cell conversion
+    unsigned int16 thermistors; // Reading both ADS7952s
+    unsigned int16 current;     // Reading the hall effect sensor
+    unsigned int16 wait;        // Polling the LTC6804s until the cell conversion is done
+    unsigned int16 cells;       // Reading back the LTC6804 cell registers
+    unsigned int16 total;       // Whole acquisition
+} acq_timing_t;
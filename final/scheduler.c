@@ -0,0 +1,99 @@
+#ifndef SCHEDULER_C
+#define SCHEDULER_C
+
+#include "timebase.c"
+
+// Cooperative scheduler driven by the millisecond timebase
+// Tasks are plain functions that run to completion from the main loop. A task
+// runs once its deadline has passed and its next deadline is one period after
+// the previous one, so a task that starts late does not drift. Tasks that are
+// due at the same time run in table order. The execution time of every run is
+// measured and the worst case is kept for telemetry.
+
+// Longer runs may have wrapped the 16 bit timebase, they are saturated
+#define SCHEDULER_WRAP_MS 50
+
+typedef void (*task_fn_t)(void);
+
+typedef struct
+{
+    task_fn_t      fn;
+    unsigned int16 period_ms;
+    unsigned int32 next_ms; // Deadline of the next run
+    unsigned int16 wcet_us; // Longest run so far, saturates at 0xFFFF
+} task_t;
+
+static task_t *      gp_tasks;
+static unsigned int8 g_n_tasks;
+
+// Takes a table of tasks, all of them are due straight away
+void scheduler_init(task_t * tasks, unsigned int8 n_tasks)
+{
+    int i;
+    
+    gp_tasks  = tasks;
+    g_n_tasks = n_tasks;
+    for (i = 0 ; i < n_tasks ; i++)
+    {
+        gp_tasks[i].next_ms = timebase_ms();
+        gp_tasks[i].wcet_us = 0;
+    }
+}
+
+// Moves the next run of a task to ms milliseconds from now
+// May be called by the task itself, to retry sooner than its period
+void scheduler_defer(unsigned int8 task, unsigned int16 ms)
+{
+    gp_tasks[task].next_ms = timebase_ms() + ms;
+}
+
+// Returns the worst case execution time of a task in microseconds
+unsigned int16 scheduler_wcet_us(unsigned int8 task)
+{
+    return gp_tasks[task].wcet_us;
+}
+
+// Runs every task that is due, once
+void scheduler_run(void)
+{
+    unsigned int8  i;
+    unsigned int32 start_ms;
+    unsigned int16 start_ticks;
+    unsigned int16 us;
+    task_t * task;
+    
+    for (i = 0 ; i < g_n_tasks ; i++)
+    {
+        task = &gp_tasks[i];
+        if (timebase_deadline_passed(task->next_ms) == false)
+        {
+            continue;
+        }
+        
+        // A task that fell a whole period behind skips the runs it missed
+        task->next_ms += task->period_ms;
+        if (timebase_deadline_passed(task->next_ms) == true)
+        {
+            task->next_ms = timebase_ms() + task->period_ms;
+        }
+        
+        start_ms    = timebase_ms();
+        start_ticks = timebase_ticks();
+        (*task->fn)();
+        if ((timebase_ms() - start_ms) >= SCHEDULER_WRAP_MS)
+        {
+            us = 0xFFFF;
+        }
+        else
+        {
+            us = TIMEBASE_TICKS_TO_US(timebase_elapsed(start_ticks));
+        }
+        
+        if (us > task->wcet_us)
+        {
+            task->wcet_us = us;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SNAPSHOT_C
+#define SNAPSHOT_C
+
+#include "timebase.c"
+#include "ltc6804.c"
+#include "adc.c"
+
+// Double buffered snapshot of the pack readings for telemetry
+// The acquisition path publishes one snapshot per complete scan by filling
+// the back buffer and then flipping g_snapshot_front, a single byte write.
+// Readers copy the front buffer and check that neither the front index nor
+// the sequence number changed while they copied, so they never see a mix of
+// two scans and never need to disable interrupts.
+
+typedef struct
+{
+    unsigned int16 seq;          // Incremented on every publish
+    unsigned int32 timestamp_ms; // timebase_ms() at publish
+    unsigned int16 voltage[N_CELLS];            // Average, 0.1mV
+    unsigned int16 temperature[N_ADC_CHANNELS]; // Average ADS7952 code
+    unsigned int16 current;                     // Average hall sensor code
+    int16          discharge[N_LTC6804];        // Discharge bits of each LTC6804
+    int1           b_connected;                 // Kilovac closed
+} snapshot_t;
+
+static snapshot_t    g_snapshot[2];
+static unsigned int8 g_snapshot_front = 0;
+static unsigned int16 g_snapshot_seq = 0;
+
+// Publishes the readings of a complete scan
+void snapshot_publish(cell_t * cell, temperature_t * temperature, unsigned int16 current, int1 b_connected)
+{
+    int i;
+    snapshot_t * back = &g_snapshot[!g_snapshot_front];
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        back->voltage[i] = cell[i].average_voltage;
+    }
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        back->temperature[i] = temperature[i].average;
+    }
+    back->current      = current;
+    back->discharge[0] = g_discharge1;
+    back->discharge[1] = g_discharge2;
+    back->discharge[2] = g_discharge3;
+    back->b_connected  = b_connected;
+    back->timestamp_ms = timebase_ms();
+    back->seq          = ++g_snapshot_seq;
+    
+    g_snapshot_front = !g_snapshot_front;
+}
+
+// Copies the latest snapshot, retrying if a publish overlapped the copy
+void snapshot_read(snapshot_t * dest)
+{
+    unsigned int8 front;
+    
+    do
+    {
+        front = g_snapshot_front;
+        *dest = g_snapshot[front];
+    } while ((front != g_snapshot_front) || (dest->seq != g_snapshot[front].seq));
+}
+
+#endif
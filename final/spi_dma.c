@@ -0,0 +1,410 @@
+#ifndef SPI_DMA_C
+#define SPI_DMA_C
+
+#include "timebase.c"
+
+// Non-blocking SPI transaction engine for SPI1 (LTC6804) and SPI2 (ADS7952)
+//
+// Each bus has a queue of transactions. A transaction drives its chip select
+// low, optionally sets the MISO mux, clocks a number of bytes, raises the chip
+// select and then calls its completion callback. The transfers are done by
+// the DMA controller, two channels per bus (one feeding SPIxBUF, one draining
+// it), so both buses can transfer at the same time while the CPU does other
+// work. The next queued transaction is started from the DMA interrupt.
+//
+// DMA channels 0-3 are used by the CAN library, this engine uses 4-7:
+//   DMA4: SPI1 transmit, DMA5: SPI1 receive
+//   DMA6: SPI2 transmit, DMA7: SPI2 receive
+//
+// Setting SPI_USE_DMA to 0 replaces the DMA backend with a polled one that
+// runs each transaction to completion inside spi_dma_submit(), with the same
+// sequencing and callbacks.
+//
+// The blocking spi_read()/spi_write() functions must only be used on a bus
+// while spi_dma_busy() is false for it.
+//
+// spi_dma_wait() gives every transaction SPI_DMA_TIMEOUT_MS to complete. If a
+// DMA or SPI completion never arrives the bus is aborted and its queue is
+// dropped without running the callbacks, so the protection loop cannot hang
+// on a dead bus.
+
+#ifndef SPI_USE_DMA
+#define SPI_USE_DMA 1
+#endif
+
+#define SPI_BUS_LTC 0 // SPI1, LTC6804
+#define SPI_BUS_ADC 1 // SPI2, ADS7952
+#define N_SPI_BUSES 2
+
+#define SPI_QUEUE_LENGTH 32 // Transactions queued per bus
+#define SPI_MAX_BYTES    16 // Longest transaction
+#define SPI_NO_MUX     0xFF // Transaction does not use the MISO mux
+#define SPI_FILL_BYTE  0xFF // Clocked out once the transmit bytes run out
+
+// Longest wait for one transaction, SPI_MAX_BYTES take 1ms at 125kHz
+#define SPI_DMA_TIMEOUT_MS 4
+
+// DMA RAM starts at this address, DMAxSTA holds an offset from it
+#define DMA_RAM_BASE 0x4000
+
+// DMAxCON values: channel enabled, byte transfers, register indirect with
+// post-increment, one-shot without ping-pong, RAM to peripheral or back
+#define DMA_CON_TX 0xE001
+#define DMA_CON_RX 0xC001
+
+// DMA request sources (IRQ numbers) of the SPI transfer done interrupts
+#define DMA_IRQ_SPI1 0x0A
+#define DMA_IRQ_SPI2 0x21
+
+#define DMA_REQ_FORCE 0x8000
+#define SPI_STAT_ROV  0x0040
+
+#word DMA4CON = getenv("SFR:DMA4CON")
+#word DMA4REQ = getenv("SFR:DMA4REQ")
+#word DMA4STA = getenv("SFR:DMA4STA")
+#word DMA4PAD = getenv("SFR:DMA4PAD")
+#word DMA4CNT = getenv("SFR:DMA4CNT")
+#word DMA5CON = getenv("SFR:DMA5CON")
+#word DMA5REQ = getenv("SFR:DMA5REQ")
+#word DMA5STA = getenv("SFR:DMA5STA")
+#word DMA5PAD = getenv("SFR:DMA5PAD")
+#word DMA5CNT = getenv("SFR:DMA5CNT")
+#word DMA6CON = getenv("SFR:DMA6CON")
+#word DMA6REQ = getenv("SFR:DMA6REQ")
+#word DMA6STA = getenv("SFR:DMA6STA")
+#word DMA6PAD = getenv("SFR:DMA6PAD")
+#word DMA6CNT = getenv("SFR:DMA6CNT")
+#word DMA7CON = getenv("SFR:DMA7CON")
+#word DMA7REQ = getenv("SFR:DMA7REQ")
+#word DMA7STA = getenv("SFR:DMA7STA")
+#word DMA7PAD = getenv("SFR:DMA7PAD")
+#word DMA7CNT = getenv("SFR:DMA7CNT")
+#word SPI1STAT = getenv("SFR:SPI1STAT")
+#word SPI1BUF  = getenv("SFR:SPI1BUF")
+#word SPI2STAT = getenv("SFR:SPI2STAT")
+#word SPI2BUF  = getenv("SFR:SPI2BUF")
+
+// Called from the DMA interrupt once a transaction is complete
+// The argument is the tag the transaction was submitted with. Keep it short,
+// it holds off the next transaction and every interrupt at or below level 5.
+typedef void (*spi_callback_t)(unsigned int8);
+
+typedef struct
+{
+    int16            cs_pin;    // Chip select, active low
+    unsigned int8    mux;       // MISO mux S[1:0], or SPI_NO_MUX
+    unsigned int8    length;    // Number of bytes to clock
+    unsigned int8    tx_length; // Bytes taken from tx, the rest is SPI_FILL_BYTE
+    unsigned int8  * tx;        // Bytes to send
+    unsigned int8  * rx;        // Where to store the received bytes, or 0
+    spi_callback_t   callback;  // Completion callback, or 0
+    unsigned int8    tag;       // Passed to the callback
+} spi_txn_t;
+
+typedef struct
+{
+    spi_txn_t      queue[SPI_QUEUE_LENGTH];
+    unsigned int8  head;  // Next transaction to start
+    unsigned int8  tail;  // Next free slot
+    int1           b_busy;
+} spi_bus_t;
+
+static spi_bus_t g_spi_bus[N_SPI_BUSES];
+
+#if SPI_USE_DMA
+#BANK_DMA
+static unsigned int8 g_spi_dma_tx[N_SPI_BUSES][SPI_MAX_BYTES];
+#BANK_DMA
+static unsigned int8 g_spi_dma_rx[N_SPI_BUSES][SPI_MAX_BYTES];
+#endif
+
+// Drives the chip select low and routes the MISO mux for a transaction
+void spi_dma_select(spi_txn_t * txn)
+{
+    if (txn->mux != SPI_NO_MUX)
+    {
+        output_bit(MISO_SEL0, bit_test(txn->mux, 0));
+        output_bit(MISO_SEL1, bit_test(txn->mux, 1));
+    }
+    output_low(txn->cs_pin);
+}
+
+// Raises the chip select, stores the received bytes and runs the callback
+void spi_dma_finish(spi_txn_t * txn, unsigned int8 * rx)
+{
+    unsigned int8 i;
+    
+    output_high(txn->cs_pin);
+    
+    if (txn->rx != 0)
+    {
+        for (i = 0 ; i < txn->length ; i++)
+        {
+            txn->rx[i] = rx[i];
+        }
+    }
+    
+    if (txn->callback != 0)
+    {
+        (*txn->callback)(txn->tag);
+    }
+}
+
+#if SPI_USE_DMA
+
+// Starts the transaction at the head of a bus queue
+// Called with the bus idle, from the main loop or the DMA interrupt
+void spi_dma_start(unsigned int8 bus)
+{
+    unsigned int8 i;
+    unsigned int8 junk;
+    spi_txn_t * txn = &g_spi_bus[bus].queue[g_spi_bus[bus].head];
+    
+    for (i = 0 ; i < txn->length ; i++)
+    {
+        if (i < txn->tx_length)
+        {
+            g_spi_dma_tx[bus][i] = txn->tx[i];
+        }
+        else
+        {
+            g_spi_dma_tx[bus][i] = SPI_FILL_BYTE;
+        }
+    }
+    
+    g_spi_bus[bus].b_busy = true;
+    spi_dma_select(txn);
+    
+    // The receive channel is armed first so no byte is missed, then the
+    // first transmit request is forced to start the transfer
+    if (bus == SPI_BUS_LTC)
+    {
+        junk = SPI1BUF;
+        SPI1STAT &= ~SPI_STAT_ROV;
+        DMA5CNT = txn->length - 1;
+        DMA5CON = DMA_CON_RX;
+        DMA4CNT = txn->length - 1;
+        DMA4CON = DMA_CON_TX;
+        DMA4REQ |= DMA_REQ_FORCE;
+    }
+    else
+    {
+        junk = SPI2BUF;
+        SPI2STAT &= ~SPI_STAT_ROV;
+        DMA7CNT = txn->length - 1;
+        DMA7CON = DMA_CON_RX;
+        DMA6CNT = txn->length - 1;
+        DMA6CON = DMA_CON_TX;
+        DMA6REQ |= DMA_REQ_FORCE;
+    }
+}
+
+// Completes the running transaction of a bus and starts the next one
+void spi_dma_complete(unsigned int8 bus)
+{
+    spi_txn_t * txn = &g_spi_bus[bus].queue[g_spi_bus[bus].head];
+    
+    // Late completion of an aborted transaction
+    if (g_spi_bus[bus].b_busy == false)
+    {
+        return;
+    }
+    
+    spi_dma_finish(txn, g_spi_dma_rx[bus]);
+    
+    g_spi_bus[bus].head = (g_spi_bus[bus].head + 1) % SPI_QUEUE_LENGTH;
+    if (g_spi_bus[bus].head != g_spi_bus[bus].tail)
+    {
+        spi_dma_start(bus);
+    }
+    else
+    {
+        g_spi_bus[bus].b_busy = false;
+    }
+}
+
+// SPI1 receive channel done, the last byte of the transaction has arrived
+#int_dma5 level = 5
+void isr_dma5(void)
+{
+    spi_dma_complete(SPI_BUS_LTC);
+}
+
+// SPI2 receive channel done, the last byte of the transaction has arrived
+#int_dma7 level = 5
+void isr_dma7(void)
+{
+    spi_dma_complete(SPI_BUS_ADC);
+}
+
+#else
+
+// Runs a transaction to completion with the blocking SPI functions
+void spi_dma_run(unsigned int8 bus, spi_txn_t * txn)
+{
+    unsigned int8 i;
+    unsigned int8 tx;
+    unsigned int8 rx[SPI_MAX_BYTES];
+    
+    spi_dma_select(txn);
+    for (i = 0 ; i < txn->length ; i++)
+    {
+        if (i < txn->tx_length)
+        {
+            tx = txn->tx[i];
+        }
+        else
+        {
+            tx = SPI_FILL_BYTE;
+        }
+        
+        if (bus == SPI_BUS_LTC)
+        {
+            rx[i] = spi_read(tx);
+        }
+        else
+        {
+            rx[i] = spi_read2(tx);
+        }
+    }
+    spi_dma_finish(txn, rx);
+}
+
+#endif
+
+// Configures the DMA channels of both buses and empties the queues
+void spi_dma_init(void)
+{
+    unsigned int8 bus;
+    
+    for (bus = 0 ; bus < N_SPI_BUSES ; bus++)
+    {
+        g_spi_bus[bus].head   = 0;
+        g_spi_bus[bus].tail   = 0;
+        g_spi_bus[bus].b_busy = false;
+    }
+
+#if SPI_USE_DMA
+    DMA4CON = 0;
+    DMA4REQ = DMA_IRQ_SPI1;
+    DMA4STA = (unsigned int16)(&g_spi_dma_tx[SPI_BUS_LTC][0]) - DMA_RAM_BASE;
+    DMA4PAD = getenv("SFR:SPI1BUF");
+    DMA5CON = 0;
+    DMA5REQ = DMA_IRQ_SPI1;
+    DMA5STA = (unsigned int16)(&g_spi_dma_rx[SPI_BUS_LTC][0]) - DMA_RAM_BASE;
+    DMA5PAD = getenv("SFR:SPI1BUF");
+    
+    DMA6CON = 0;
+    DMA6REQ = DMA_IRQ_SPI2;
+    DMA6STA = (unsigned int16)(&g_spi_dma_tx[SPI_BUS_ADC][0]) - DMA_RAM_BASE;
+    DMA6PAD = getenv("SFR:SPI2BUF");
+    DMA7CON = 0;
+    DMA7REQ = DMA_IRQ_SPI2;
+    DMA7STA = (unsigned int16)(&g_spi_dma_rx[SPI_BUS_ADC][0]) - DMA_RAM_BASE;
+    DMA7PAD = getenv("SFR:SPI2BUF");
+    
+    enable_interrupts(INT_DMA5);
+    enable_interrupts(INT_DMA7);
+#endif
+}
+
+// Adds a transaction to the queue of a bus, starting it if the bus is idle
+// The transaction is copied, but the tx and rx buffers it points to must stay
+// valid until its callback has run. Returns 0 if the queue is full.
+int1 spi_dma_submit(unsigned int8 bus, spi_txn_t * txn)
+{
+#if SPI_USE_DMA
+    unsigned int8 next;
+    
+    disable_interrupts(INT_DMA5);
+    disable_interrupts(INT_DMA7);
+    
+    next = (g_spi_bus[bus].tail + 1) % SPI_QUEUE_LENGTH;
+    if (next == g_spi_bus[bus].head)
+    {
+        enable_interrupts(INT_DMA5);
+        enable_interrupts(INT_DMA7);
+        return false;
+    }
+    
+    g_spi_bus[bus].queue[g_spi_bus[bus].tail] = *txn;
+    g_spi_bus[bus].tail = next;
+    if (g_spi_bus[bus].b_busy == false)
+    {
+        spi_dma_start(bus);
+    }
+    
+    enable_interrupts(INT_DMA5);
+    enable_interrupts(INT_DMA7);
+#else
+    spi_dma_run(bus, txn);
+#endif
+    
+    return true;
+}
+
+// Returns 1 while a bus has queued or running transactions
+int1 spi_dma_busy(unsigned int8 bus)
+{
+    return g_spi_bus[bus].b_busy;
+}
+
+// Stops the running transaction of a bus and drops the rest of its queue
+// The callbacks of the dropped transactions are not run
+void spi_dma_abort(unsigned int8 bus)
+{
+#if SPI_USE_DMA
+    disable_interrupts(INT_DMA5);
+    disable_interrupts(INT_DMA7);
+    
+    if (bus == SPI_BUS_LTC)
+    {
+        DMA4CON = 0;
+        DMA5CON = 0;
+        clear_interrupt(INT_DMA5);
+    }
+    else
+    {
+        DMA6CON = 0;
+        DMA7CON = 0;
+        clear_interrupt(INT_DMA7);
+    }
+    
+    if (g_spi_bus[bus].b_busy == true)
+    {
+        output_high(g_spi_bus[bus].queue[g_spi_bus[bus].head].cs_pin);
+    }
+    g_spi_bus[bus].head   = g_spi_bus[bus].tail;
+    g_spi_bus[bus].b_busy = false;
+    
+    enable_interrupts(INT_DMA5);
+    enable_interrupts(INT_DMA7);
+#endif
+}
+
+// Waits until every transaction queued on a bus has completed
+// A transaction still running SPI_DMA_TIMEOUT_MS after the previous one
+// completed aborts the bus. Returns 0 if the bus was aborted.
+int1 spi_dma_wait(unsigned int8 bus)
+{
+    unsigned int8  head = g_spi_bus[bus].head;
+    unsigned int32 start_ms = timebase_ms();
+    
+    while (spi_dma_busy(bus) == true)
+    {
+        // Transfers run in the background
+        if (g_spi_bus[bus].head != head)
+        {
+            head = g_spi_bus[bus].head;
+            start_ms = timebase_ms();
+        }
+        else if ((timebase_ms() - start_ms) > SPI_DMA_TIMEOUT_MS)
+        {
+            spi_dma_abort(bus);
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef SPI_LINK_C
+#define SPI_LINK_C
+
+#include "spi_dma.c"
+
+// Link speed manager for SPI1 (LTC6804) and SPI2 (ADS7952)
+//
+// Both buses start at the 125kHz set by #use spi in main.h. After every scan
+// the driver reports whether the link was clean: every LTC6804 register group
+// passed its PEC check, or every ADS7952 channel address came back exactly
+// once. After SPI_LINK_STEP_PASSES clean scans the bus moves up one speed
+// level, up to the limit of the part on it. An error moves it down one level
+// straight away, and the bus then stays put for SPI_LINK_HOLD_PASSES clean
+// scans before it tries to go faster again.
+//
+// A bus that had to be aborted because a transaction never completed is
+// counted as a timeout. The scan it belonged to is reported as an error.
+//
+// The baud rate is set by the SPIxCON1 prescalers, Fsck = Fcy/(primary *
+// secondary) with Fcy = 10MHz. It may only be changed while the bus is idle.
+
+#define N_SPI_LINK_LEVELS    7
+#define SPI_LINK_MAX_LTC     3    // 833kHz, the LTC6804 is rated to 1MHz
+#define SPI_LINK_MAX_ADC     6    // 5MHz
+#define SPI_LINK_STEP_PASSES 50   // Clean scans before stepping up
+#define SPI_LINK_HOLD_PASSES 1000 // Clean scans before retrying after an error
+
+// SPIxCON1 SPRE[2:0] and PPRE[1:0] bits
+#define SPI_CON1_PRESCALE_MASK 0x001F
+#define SPI_STAT_SPIEN         15
+
+#word SPI1CON1 = getenv("SFR:SPI1CON1")
+#word SPI2CON1 = getenv("SFR:SPI2CON1")
+
+// Prescaler bits and resulting clock in kHz of each speed level
+//                         Secondary, primary: 5x16, 8x4, 5x4, 3x4, 2x4, 1x4, 2x1
+const unsigned int8  g_spi_link_prescale[N_SPI_LINK_LEVELS] = {0x0D, 0x02, 0x0E, 0x16, 0x1A, 0x1E, 0x1B};
+const unsigned int16 g_spi_link_khz[N_SPI_LINK_LEVELS]      = { 125,  312,  500,  833, 1250, 2500, 5000};
+
+typedef struct
+{
+    unsigned int8  level;     // Current speed level
+    unsigned int8  max_level; // Fastest level the part on the bus supports
+    unsigned int16 clean;     // Clean scans since the last level change
+    unsigned int16 hold;      // Clean scans needed before stepping up
+    unsigned int8  backoffs;  // Number of times the bus stepped down
+    unsigned int8  timeouts;  // Number of times the bus was aborted
+} spi_link_t;
+
+static spi_link_t g_spi_link[N_SPI_BUSES];
+
+// Writes the prescalers of the current level of a bus
+void spi_link_apply(unsigned int8 bus)
+{
+    unsigned int16 prescale = g_spi_link_prescale[g_spi_link[bus].level];
+    
+    if (bus == SPI_BUS_LTC)
+    {
+        bit_clear(SPI1STAT, SPI_STAT_SPIEN);
+        SPI1CON1 = (SPI1CON1 & ~SPI_CON1_PRESCALE_MASK) | prescale;
+        bit_set(SPI1STAT, SPI_STAT_SPIEN);
+    }
+    else
+    {
+        bit_clear(SPI2STAT, SPI_STAT_SPIEN);
+        SPI2CON1 = (SPI2CON1 & ~SPI_CON1_PRESCALE_MASK) | prescale;
+        bit_set(SPI2STAT, SPI_STAT_SPIEN);
+    }
+}
+
+// Puts both buses at the slowest level
+void spi_link_init(void)
+{
+    int i;
+    
+    for (i = 0 ; i < N_SPI_BUSES ; i++)
+    {
+        g_spi_link[i].level    = 0;
+        g_spi_link[i].clean    = 0;
+        g_spi_link[i].hold     = SPI_LINK_STEP_PASSES;
+        g_spi_link[i].backoffs = 0;
+        g_spi_link[i].timeouts = 0;
+        spi_link_apply(i);
+    }
+    g_spi_link[SPI_BUS_LTC].max_level = SPI_LINK_MAX_LTC;
+    g_spi_link[SPI_BUS_ADC].max_level = SPI_LINK_MAX_ADC;
+}
+
+// Reports the outcome of one scan on a bus and adjusts its speed
+// Must be called while the bus is idle
+void spi_link_report(unsigned int8 bus, int1 b_error)
+{
+    spi_link_t * link = &g_spi_link[bus];
+    
+    if (b_error == true)
+    {
+        if (link->level > 0)
+        {
+            link->level--;
+            link->backoffs++;
+            spi_link_apply(bus);
+        }
+        link->clean = 0;
+        link->hold  = SPI_LINK_HOLD_PASSES;
+    }
+    else if (link->level < link->max_level)
+    {
+        link->clean++;
+        if (link->clean >= link->hold)
+        {
+            link->level++;
+            link->clean = 0;
+            link->hold  = SPI_LINK_STEP_PASSES;
+            spi_link_apply(bus);
+        }
+    }
+}
+
+// Counts a transaction on a bus that never completed
+void spi_link_timeout(unsigned int8 bus)
+{
+    if (g_spi_link[bus].timeouts < 0xFF)
+    {
+        g_spi_link[bus].timeouts++;
+    }
+}
+
+// Returns the current speed level of a bus
+unsigned int8 spi_link_level(unsigned int8 bus)
+{
+    return g_spi_link[bus].level;
+}
+
+// Returns the current clock of a bus in kHz
+unsigned int16 spi_link_khz(unsigned int8 bus)
+{
+    return g_spi_link_khz[g_spi_link[bus].level];
+}
+
+// Returns the number of times a bus stepped down after an error
+unsigned int8 spi_link_backoffs(unsigned int8 bus)
+{
+    return g_spi_link[bus].backoffs;
+}
+
+// Returns the number of times a bus was aborted
+unsigned int8 spi_link_timeouts(unsigned int8 bus)
+{
+    return g_spi_link[bus].timeouts;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef HOST_H
+#define HOST_H
+
+// Host build of the firmware modules for the unit tests and benchmarks
+//
+// Maps the CCS PCD integer types and built-ins used by the modules onto
+// standard C, so a test can include a module .c file directly and run it
+// with gcc. Pins only record their last level, delays advance the simulated
+// clock of host_time.h. A test that replaces a module with a stub defines
+// the include guard of that module before including the module under test.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// CCS PCD integer types, int8/16/32 are signed unless marked unsigned
+#define int1  _Bool
+#define int8  char
+#define int16 short
+#define int32 int
+
+#define true  1
+#define false 0
+
+// CCS built-ins
+#define make8(value, n)      ((unsigned char)((value) >> (8*(n))))
+#define make16(high, low)    ((unsigned short)(((unsigned char)(high) << 8) | (unsigned char)(low)))
+#define bit_test(value, n)   ((((value) >> (n)) & 1) != 0)
+#define bit_set(value, n)    ((value) |= (1 << (n)))
+#define bit_clear(value, n)  ((value) &= ~(1 << (n)))
+
+// Timer 3 runs from the simulated clock, see host_time.h
+static unsigned long long g_host_us = 0;
+#define TMR_INTERNAL            0
+#define TMR_DIV_BY_8            0
+#define setup_timer3(mode, period)
+#define get_timer3()            ((unsigned short)((g_host_us*5)/4))
+
+void host_delay_us(unsigned long long us);
+#define delay_us(us) host_delay_us(us)
+#define delay_ms(ms) host_delay_us((unsigned long long)(ms)*1000)
+
+// Pins, the level of each is kept and can be traced
+#define N_HOST_PINS 128
+static unsigned char g_host_pin[N_HOST_PINS];
+static void (*gp_host_pin_hook)(int pin, int level) = 0;
+
+static void host_pin_write(int pin, int level)
+{
+    g_host_pin[pin] = level;
+    if (gp_host_pin_hook != 0)
+    {
+        (*gp_host_pin_hook)(pin, level);
+    }
+}
+
+#define output_low(pin)         host_pin_write(pin, 0)
+#define output_high(pin)        host_pin_write(pin, 1)
+#define output_bit(pin, level)  host_pin_write(pin, (level) != 0)
+
+// Checks, a failed check is reported and fails the test at the end
+static int g_host_failures = 0;
+
+#define CHECK(cond)                                                           \
+    do                                                                        \
+    {                                                                         \
+        if (!(cond))                                                          \
+        {                                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+            g_host_failures++;                                                \
+        }                                                                     \
+    } while (0)
+
+// Prints the outcome of a test, returns its exit code
+static int host_report(const char * name)
+{
+    if (g_host_failures != 0)
+    {
+        printf("%s: FAILED, %d checks\n", name, g_host_failures);
+        return 1;
+    }
+    printf("%s: passed\n", name);
+    return 0;
+}
+
+// Returns the host CPU time in nanoseconds, for the benchmarks
+static double host_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef HOST_TIME_H
+#define HOST_TIME_H
+
+#include "host.h"
+#include "../timebase.c"
+
+// Simulated clock for the host tests
+// Timer 3 follows g_host_us and the millisecond count moves on by every
+// millisecond boundary the clock passes, as if the 1ms interrupt had run.
+
+// Advances the simulated clock
+void host_delay_us(unsigned long long us)
+{
+    unsigned long long end = g_host_us + us;
+
+    g_timebase_ms += (unsigned int32)((end / 1000) - (g_host_us / 1000));
+    g_host_us = end;
+}
+
+// Moves the clock to a millisecond count, which must not be in the past
+void host_set_ms(unsigned long long ms)
+{
+    host_delay_us((ms * 1000) - g_host_us);
+}
+
+#endif
@@ -0,0 +1,344 @@
+// Balancing planner against simulated packs
+//
+// The LTC6804 driver is replaced by the cell array and discharge words the
+// planner works on. The simulated cells lose 0.1mV of voltage for every
+// BALANCE_MS_PER_100UV they bleed, the charge model the planner assumes, and
+// the planner is run period by period the way begin_balance_state() and
+// balancing_state() run it. The same packs are also balanced with the
+// threshold policy the planner replaced, which bleeds every cell above the
+// band for whole periods.
+
+#include "host.h"
+
+// Stub of the LTC6804 driver
+#define LTC6804_C
+#define N_CELLS   30
+#define N_LTC6804 3
+
+typedef struct
+{
+    unsigned int16 average_voltage;
+} cell_t;
+
+static int16 g_discharge1;
+static int16 g_discharge2;
+static int16 g_discharge3;
+static signed int16 g_ltc6804_die_temp[N_LTC6804];
+
+#include "../balance.c"
+
+// Voltage the simulated cells lose per slot of bleeding, 0.1mV
+#define SLOT_DROP ((double)BALANCE_SLOT_MS / BALANCE_MS_PER_100UV)
+
+// Longest simulated balancing run
+#define MAX_PERIODS 200000
+
+typedef struct
+{
+    unsigned long periods;   // Periods until every cell was within the band
+    double        overshoot; // Furthest a cell that bled ended below the band, 0.1mV
+} sim_result_t;
+
+static cell_t g_cell[N_CELLS];
+static double g_volts[N_CELLS]; // True cell voltages, 0.1mV
+static double g_start[N_CELLS]; // True cell voltages before balancing
+
+static int discharging(unsigned int8 cell)
+{
+    if (cell < 12)
+    {
+        return bit_test(g_discharge1, cell);
+    }
+    else if (cell < 24)
+    {
+        return bit_test(g_discharge2, cell - 12);
+    }
+    return bit_test(g_discharge3, cell - 24);
+}
+
+// Sets every cell a number of 0.1mV above 39000 (3.9V)
+static void load_pack(const unsigned int16 * deltas)
+{
+    int i;
+
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_volts[i] = 39000 + deltas[i];
+        g_start[i] = g_volts[i];
+        g_cell[i].average_voltage = (unsigned int16)(g_volts[i] + 0.5);
+    }
+}
+
+static void measure(void)
+{
+    int i;
+
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_cell[i].average_voltage = (unsigned int16)(g_volts[i] + 0.5);
+    }
+}
+
+static double lowest_volts(void)
+{
+    int i;
+    double lowest = g_volts[0];
+
+    for (i = 1 ; i < N_CELLS ; i++)
+    {
+        if (g_volts[i] < lowest)
+        {
+            lowest = g_volts[i];
+        }
+    }
+    return lowest;
+}
+
+static sim_result_t result(unsigned long periods, double lowest)
+{
+    int i;
+    sim_result_t r;
+
+    r.periods = periods;
+    r.overshoot = 0;
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        if ((g_start[i] > (lowest + BALANCE_THRESHOLD)) && ((lowest + BALANCE_THRESHOLD - g_volts[i]) > r.overshoot))
+        {
+            r.overshoot = lowest + BALANCE_THRESHOLD - g_volts[i];
+        }
+    }
+    return r;
+}
+
+// Balances the loaded pack with the planner
+static sim_result_t run_planner(signed int16 die_temp)
+{
+    int i;
+    unsigned long period;
+    unsigned int8 slot;
+    double lowest = lowest_volts();
+
+    balance_init();
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        g_ltc6804_die_temp[i] = die_temp;
+    }
+
+    for (period = 0 ; period < MAX_PERIODS ; period++)
+    {
+        measure();
+        balance_plan(g_cell);
+        if (g_balance.state == BALANCE_BALANCED)
+        {
+            return result(period, lowest);
+        }
+        for (slot = 0 ; slot < N_BALANCE_SLOTS ; slot++)
+        {
+            balance_govern(250);
+            balance_apply_slot(slot);
+            for (i = 0 ; i < N_CELLS ; i++)
+            {
+                if (discharging(i))
+                {
+                    g_volts[i] -= SLOT_DROP;
+                }
+            }
+        }
+        balance_end();
+    }
+    return result(MAX_PERIODS, lowest);
+}
+
+// Balances the loaded pack with the threshold policy, every cell above the
+// band bleeds for the whole period
+static sim_result_t run_threshold(void)
+{
+    int i;
+    unsigned long period;
+    int1 b_any;
+    double lowest = lowest_volts();
+
+    for (period = 0 ; period < MAX_PERIODS ; period++)
+    {
+        measure();
+        b_any = false;
+        for (i = 0 ; i < N_CELLS ; i++)
+        {
+            if ((g_cell[i].average_voltage - (unsigned int16)(lowest + 0.5)) > BALANCE_THRESHOLD)
+            {
+                g_volts[i] -= N_BALANCE_SLOTS * SLOT_DROP;
+                b_any = true;
+            }
+        }
+        if (b_any == false)
+        {
+            return result(period, lowest);
+        }
+    }
+    return result(MAX_PERIODS, lowest);
+}
+
+// Slots a cell bleeds in a pack that does not move, until its budget is spent
+static unsigned long budget_slots(unsigned int16 delta)
+{
+    static unsigned int16 deltas[N_CELLS];
+    unsigned long slots = 0;
+    unsigned int8 slot = 0;
+
+    memset(deltas, 0, sizeof(deltas));
+    deltas[1] = BALANCE_THRESHOLD + delta;
+    load_pack(deltas);
+    balance_init();
+    balance_plan(g_cell);
+    while (g_balance_budget_ms[1] > 0)
+    {
+        balance_apply_slot(slot);
+        slot = (slot + 1) % N_BALANCE_SLOTS;
+        slots++;
+    }
+    return slots;
+}
+
+// A small and a large imbalance get budgets in proportion to their charge
+static void test_budget_scales(void)
+{
+    unsigned long slots_1mv = budget_slots(10);
+    unsigned long slots_20mv = budget_slots(200);
+
+    printf("bleed budget: 1mV over the band %lu slots, 20mV %lu slots\n", slots_1mv, slots_20mv);
+    CHECK(slots_1mv != slots_20mv);
+    CHECK(slots_1mv == (10UL*BALANCE_MS_PER_100UV + BALANCE_SLOT_MS - 1)/BALANCE_SLOT_MS);
+    CHECK(slots_20mv == (200UL*BALANCE_MS_PER_100UV + BALANCE_SLOT_MS - 1)/BALANCE_SLOT_MS);
+}
+
+// Budgets shrink by one slot for every slot a cell bleeds, carry across
+// periods, and a cell back in the band drops out at the next plan
+static void test_budget_carry(void)
+{
+    static unsigned int16 deltas[N_CELLS];
+    unsigned int32 before;
+
+    memset(deltas, 0, sizeof(deltas));
+    deltas[1] = BALANCE_THRESHOLD + 10;
+    deltas[2] = BALANCE_THRESHOLD + 200;
+    deltas[3] = BALANCE_THRESHOLD;
+    load_pack(deltas);
+    balance_init();
+    balance_plan(g_cell);
+    CHECK(g_balance.state == BALANCE_BLEEDING);
+    CHECK(g_balance.n_active == 2);
+    CHECK(g_balance_budget_ms[3] == 0);
+    CHECK(g_balance.eta_ms == 200UL*BALANCE_MS_PER_100UV);
+
+    before = g_balance_budget_ms[2];
+    balance_apply_slot(0);
+    CHECK(discharging(1) && discharging(2) && !discharging(3));
+    CHECK(g_balance_budget_ms[2] == before - BALANCE_SLOT_MS);
+    balance_end();
+
+    // The next period keeps the budget instead of estimating it again
+    before = g_balance_budget_ms[2];
+    balance_plan(g_cell);
+    CHECK(g_balance_budget_ms[2] == before);
+
+    // Cell 2 falls into the band
+    g_cell[2].average_voltage = 39000 + BALANCE_THRESHOLD;
+    balance_plan(g_cell);
+    CHECK(g_balance_budget_ms[2] == 0);
+    CHECK(g_balance.n_active == 1);
+
+    // Stopping drops every budget
+    balance_stop();
+    CHECK(g_balance_budget_ms[1] == 0);
+}
+
+// A hot chip bleeds no more cells at once than its cap
+static void test_thermal_cap(void)
+{
+    static unsigned int16 deltas[N_CELLS];
+    int i;
+    int n;
+    unsigned int8 slot;
+
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        deltas[i] = (i == 0) ? 0 : BALANCE_THRESHOLD + 100;
+    }
+    load_pack(deltas);
+    balance_init();
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        g_ltc6804_die_temp[i] = 800; // 80 degC, 2 cells per chip
+    }
+    balance_plan(g_cell);
+    for (slot = 0 ; slot < N_BALANCE_SLOTS ; slot++)
+    {
+        balance_govern(250);
+        balance_apply_slot(slot);
+        n = 0;
+        for (i = 0 ; i < 12 ; i++)
+        {
+            n += discharging(i);
+        }
+        CHECK(n == 2);
+    }
+}
+
+static const unsigned int16 g_pack_spread[N_CELLS] =
+{
+      0,  20,  40,  60,  80, 100, 120, 140, 160, 180,
+    200, 220, 240, 260, 280, 300, 320, 340, 360, 380,
+    400, 450, 500, 510, 520, 550, 600, 700, 800, 900,
+};
+
+static const unsigned int16 g_pack_one_high[N_CELLS] =
+{
+      0, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+    100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+    100, 100, 100, 100, 100, 100, 100, 100, 100, 700,
+};
+
+static const unsigned int16 g_pack_just_over[N_CELLS] =
+{
+      0, 501, 502, 503, 504, 505, 506, 507, 508, 509,
+    510, 300, 300, 300, 300, 300, 300, 300, 300, 300,
+    300, 300, 300, 300, 300, 300, 300, 300, 300, 300,
+};
+
+// Compares convergence and overshoot with the threshold policy
+static void test_convergence(const char * name, const unsigned int16 * pack, signed int16 die_temp)
+{
+    sim_result_t planner;
+    sim_result_t threshold;
+
+    load_pack(pack);
+    planner = run_planner(die_temp);
+    load_pack(pack);
+    threshold = run_threshold();
+
+    printf("%-22s planner %5lu periods, %5.3f mV under the band, threshold %5lu periods, %5.3f mV under\n",
+           name, planner.periods, planner.overshoot/10, threshold.periods, threshold.overshoot/10);
+
+    CHECK(planner.periods < MAX_PERIODS);
+    // No cell bleeds more than one slot past its budget
+    CHECK(planner.overshoot <= SLOT_DROP + 0.5);
+    CHECK(planner.overshoot <= threshold.overshoot + 0.5);
+    if (die_temp <= BALANCE_DIE_TEMP_FULL)
+    {
+        // Without a cap the planner is never slower than bleeding whole periods
+        CHECK(planner.periods <= threshold.periods + 1);
+    }
+}
+
+int main(void)
+{
+    test_budget_scales();
+    test_budget_carry();
+    test_thermal_cap();
+    test_convergence("spread to 90mV", g_pack_spread, 400);
+    test_convergence("one cell 70mV high", g_pack_one_high, 400);
+    test_convergence("just over the band", g_pack_just_over, 400);
+    test_convergence("spread, 80degC dies", g_pack_spread, 800);
+    return host_report("test_balance");
+}
@@ -0,0 +1,144 @@
+// Trip latency of every fault class
+//
+// Drives debounce_update() the way the protection task samples each class
+// and measures the time from the fault appearing to the trip, for every
+// phase of the fault against the sample times. The worst case must lie
+// between the hold time and the hold time plus two sample periods: up to one
+// period before the first bad sample is seen, and the hold time rounded up
+// to whole periods after it.
+
+#include "host_time.h"
+#include "../debounce.c"
+
+// Sample periods of the protection task
+#define PROTECT_PERIOD_MS   10 // Every pass, current and thermistors
+#define FILTERED_PERIOD_MS 210 // Filtered mode cell conversion, 201ms rounded up to a pass
+#define WINDOW_PERIOD       4  // Conversions per measurement window while bleeding
+
+typedef struct
+{
+    const char *   name;
+    unsigned int16 hold_ms;
+    unsigned int16 period_ms;
+} fault_class_t;
+
+static const fault_class_t g_classes[] =
+{
+    {"OV fast/normal",           OV_DEBOUNCE_MS,   PROTECT_PERIOD_MS},
+    {"OV filtered",              OV_DEBOUNCE_MS,   FILTERED_PERIOD_MS},
+    {"OV bleeding, windows",     OV_DEBOUNCE_MS,   WINDOW_PERIOD*PROTECT_PERIOD_MS},
+    {"OV bleeding filtered",     OV_DEBOUNCE_MS,   WINDOW_PERIOD*FILTERED_PERIOD_MS},
+    {"UV fast/normal",           UV_DEBOUNCE_MS,   PROTECT_PERIOD_MS},
+    {"UV filtered",              UV_DEBOUNCE_MS,   FILTERED_PERIOD_MS},
+    {"OT",                       OT_DEBOUNCE_MS,   PROTECT_PERIOD_MS},
+    {"WT",                       WT_DEBOUNCE_MS,   PROTECT_PERIOD_MS},
+    {"OC",                       OC_DEBOUNCE_MS,   PROTECT_PERIOD_MS},
+    {"UC",                       UC_DEBOUNCE_MS,   PROTECT_PERIOD_MS},
+    {"LTC6804 link",             LINK_DEBOUNCE_MS, PROTECT_PERIOD_MS},
+    {"LTC6804 link filtered",    LINK_DEBOUNCE_MS, FILTERED_PERIOD_MS},
+    {"ADS7952 link",             LINK_DEBOUNCE_MS, PROTECT_PERIOD_MS},
+};
+
+#define N_CLASSES (sizeof(g_classes)/sizeof(g_classes[0]))
+
+// Samples a fault that appears phase_ms after a sample at start_ms, returns
+// the time from the fault appearing to the trip
+static unsigned long trip_latency(const fault_class_t * c, unsigned long long start_ms, unsigned int16 phase_ms)
+{
+    debounce_t debounce;
+    unsigned long long onset_ms = start_ms + phase_ms;
+    unsigned long long t_ms = start_ms;
+
+    debounce_init(&debounce);
+    host_set_ms(t_ms);
+    CHECK(debounce_update(&debounce, false, c->hold_ms) == false);
+
+    while (1)
+    {
+        t_ms += c->period_ms;
+        host_set_ms(t_ms);
+        if (debounce_update(&debounce, t_ms >= onset_ms, c->hold_ms) == true)
+        {
+            return t_ms - onset_ms;
+        }
+        if ((t_ms - onset_ms) > 10*(unsigned long)c->hold_ms + c->period_ms)
+        {
+            return 0xFFFFFFFF;
+        }
+    }
+}
+
+// A good sample restarts the hold time, and the trip clears with it
+static void test_good_sample_restarts(void)
+{
+    debounce_t debounce;
+    unsigned long long t_ms = g_host_us/1000 + 1;
+
+    debounce_init(&debounce);
+    host_set_ms(t_ms);
+    CHECK(debounce_update(&debounce, true, 300) == false);
+    host_set_ms(t_ms + 290);
+    CHECK(debounce_update(&debounce, false, 300) == false);
+    host_set_ms(t_ms + 300);
+    CHECK(debounce_update(&debounce, true, 300) == false);
+    host_set_ms(t_ms + 599);
+    CHECK(debounce_update(&debounce, true, 300) == false);
+    host_set_ms(t_ms + 600);
+    CHECK(debounce_update(&debounce, true, 300) == true);
+    host_set_ms(t_ms + 610);
+    CHECK(debounce_update(&debounce, false, 300) == false);
+}
+
+// Returns a start time after the current time, placed just before the
+// 16 bit wrap of since_ms when b_wrap is set
+static unsigned long long next_start(int b_wrap)
+{
+    unsigned long long t_ms = g_host_us/1000 + 1;
+
+    if (b_wrap)
+    {
+        t_ms += (65400 - (t_ms % 65536) + 65536) % 65536;
+    }
+    return t_ms;
+}
+
+int main(void)
+{
+    unsigned int i;
+    unsigned int16 phase;
+    unsigned long latency;
+    unsigned long worst;
+    unsigned long best;
+    int s;
+
+    printf("%-24s %6s %8s %10s %10s\n", "fault class", "hold", "period", "best", "worst");
+    for (i = 0 ; i < N_CLASSES ; i++)
+    {
+        worst = 0;
+        best = 0xFFFFFFFF;
+        for (s = 0 ; s < 2 ; s++)
+        {
+            for (phase = 1 ; phase <= g_classes[i].period_ms ; phase++)
+            {
+                latency = trip_latency(&g_classes[i], next_start(s), phase);
+                if (latency > worst)
+                {
+                    worst = latency;
+                }
+                if (latency < best)
+                {
+                    best = latency;
+                }
+            }
+        }
+        printf("%-24s %4ums %6ums %8lums %8lums\n", g_classes[i].name,
+               g_classes[i].hold_ms, g_classes[i].period_ms, best, worst);
+
+        // Never trips early, never later than two periods past the hold time
+        CHECK(best >= g_classes[i].hold_ms);
+        CHECK(worst < (unsigned long)g_classes[i].hold_ms + 2*g_classes[i].period_ms);
+    }
+
+    test_good_sample_restarts();
+    return host_report("test_debounce");
+}
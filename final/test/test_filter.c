@@ -0,0 +1,128 @@
+// Ring buffer moving average against the shift-copy loop it replaced
+//
+// Checks filter_update() against the mean of the last N samples, then times
+// one pass over 30 cells with both implementations as N grows. The ring
+// buffer costs the same at any N, the shift-copy loop grows with it.
+
+#include "host.h"
+#include "../filter.c"
+
+#define N_CELLS       30
+#define MAX_SAMPLES   80
+#define N_PASSES  200000
+
+static unsigned int16 g_samples[N_CELLS][MAX_SAMPLES];
+static filter_t       g_filter[N_CELLS];
+static unsigned int16 g_voltage[N_CELLS];
+static volatile unsigned int16 g_sink;
+
+// Average of the last length samples, the way average_voltage() did it
+static void shift_copy_pass(unsigned int8 length)
+{
+    int i;
+    int j;
+    unsigned int32 sum;
+
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        sum = 0;
+        for (j = 0 ; j < length-1 ; j++)
+        {
+            sum += g_samples[i][j+1];
+            g_samples[i][j] = g_samples[i][j+1];
+        }
+        sum += g_voltage[i];
+        g_samples[i][length-1] = g_voltage[i];
+        g_sink = (unsigned int16)(sum/length);
+    }
+}
+
+static void ring_pass(void)
+{
+    int i;
+
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_sink = filter_update(&g_filter[i], g_voltage[i]);
+    }
+}
+
+// The filter output is the mean of the last length samples, zeros included
+// until it has filled up
+static void test_matches_window_mean(unsigned int8 length)
+{
+    unsigned int16 history[1000];
+    unsigned int16 buffer[MAX_SAMPLES];
+    filter_t filter;
+    unsigned int32 sum;
+    int n;
+    int k;
+
+    filter_init(&filter, buffer, length);
+    for (n = 0 ; n < 1000 ; n++)
+    {
+        history[n] = 27500 + (rand() % 14500);
+        sum = 0;
+        for (k = n ; (k > n - length) && (k >= 0) ; k--)
+        {
+            sum += history[k];
+        }
+        CHECK(filter_update(&filter, history[n]) == sum/length);
+    }
+}
+
+static void randomize(void)
+{
+    int i;
+
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_voltage[i] = 36000 + (rand() % 6000);
+    }
+}
+
+int main(void)
+{
+    static const unsigned int8 lengths[] = {5, 10, 20, 40, 80};
+    unsigned int l;
+    int i;
+    int pass;
+    double t0;
+    double shift_ns;
+    double ring_ns;
+
+    for (l = 0 ; l < sizeof(lengths) ; l++)
+    {
+        test_matches_window_mean(lengths[l]);
+    }
+
+    printf("%8s %22s %22s\n", "samples", "shift-copy ns/pass", "ring buffer ns/pass");
+    for (l = 0 ; l < sizeof(lengths) ; l++)
+    {
+        for (i = 0 ; i < N_CELLS ; i++)
+        {
+            filter_init(&g_filter[i], g_samples[i], lengths[l]);
+        }
+        randomize();
+
+        t0 = host_ns();
+        for (pass = 0 ; pass < N_PASSES ; pass++)
+        {
+            g_voltage[pass % N_CELLS]++;
+            shift_copy_pass(lengths[l]);
+        }
+        shift_ns = (host_ns() - t0) / N_PASSES;
+
+        t0 = host_ns();
+        for (pass = 0 ; pass < N_PASSES ; pass++)
+        {
+            g_voltage[pass % N_CELLS]++;
+            ring_pass();
+        }
+        ring_ns = (host_ns() - t0) / N_PASSES;
+
+        printf("%8u %22.1f %22.1f\n", lengths[l], shift_ns, ring_ns);
+    }
+
+    return host_report("test_filter");
+}
@@ -0,0 +1,240 @@
+// PEC15 table and command PECs, and the bitwise, nibble table and byte table
+// implementations of the CRC
+//
+// pec15Table and every precomputed command PEC in ltc6804.c are checked
+// against a bit by bit CRC of the LTC6804 polynomial. The three variants are
+// then timed over register group data and command frames. The nibble table
+// is 32 bytes, the byte table 512 bytes of program memory.
+
+#include "host.h"
+
+// Stub of the SPI driver, only the command constants are used
+#define SPI_LINK_C
+#define SPI_DMA_C
+#define SPI_BUS_LTC 0
+#define CSBI1       1
+#define CSBI2       2
+#define CSBI3       3
+#define MISO_SEL0   4
+#define MISO_SEL1   5
+
+typedef void (*spi_callback_t)(unsigned int8);
+
+typedef struct
+{
+    int16            cs_pin;
+    unsigned int8    mux;
+    unsigned int8    length;
+    unsigned int8    tx_length;
+    unsigned int8  * tx;
+    unsigned int8  * rx;
+    spi_callback_t   callback;
+    unsigned int8    tag;
+} spi_txn_t;
+
+void host_delay_us(unsigned long long us) {}
+static int1 spi_dma_submit(unsigned int8 bus, spi_txn_t * txn) { return true; }
+static int1 spi_dma_wait(unsigned int8 bus) { return true; }
+static void spi_link_report(unsigned int8 bus, int1 b_error) {}
+static void spi_link_timeout(unsigned int8 bus) {}
+static unsigned int8 spi_read(unsigned int8 data) { return 0xFF; }
+static void spi_write(unsigned int8 data) {}
+
+#include "../ltc6804.c"
+
+#define N_PASSES 2000000
+
+static unsigned int16 g_nibble_table[16];
+static volatile unsigned int16 g_sink;
+
+// One bit at a time, as in the LTC6804 datasheet
+static unsigned int16 pec15_bitwise(char * data, int len)
+{
+    unsigned int16 remainder = 16;
+    int i;
+    int bit;
+
+    for (i = 0 ; i < len ; i++)
+    {
+        for (bit = 7 ; bit >= 0 ; bit--)
+        {
+            if ((((remainder >> 14) ^ (data[i] >> bit)) & 1) != 0)
+            {
+                remainder = (remainder << 1) ^ CRC15_POLY;
+            }
+            else
+            {
+                remainder = remainder << 1;
+            }
+        }
+    }
+    return (remainder * 2) & 0xFFFE;
+}
+
+// Table entry of the top n bits of the remainder, as init_PEC15_Table() did
+// for 8 bits
+static unsigned int16 pec15_entry(unsigned int16 i, int bits)
+{
+    unsigned int16 remainder = i << (15 - bits);
+    int bit;
+
+    for (bit = 0 ; bit < bits ; bit++)
+    {
+        if (remainder & 0x4000)
+        {
+            remainder = (remainder << 1) ^ CRC15_POLY;
+        }
+        else
+        {
+            remainder = remainder << 1;
+        }
+    }
+    return remainder;
+}
+
+// Four bits at a time from a 16 entry table
+static unsigned int16 pec15_nibble(char * data, int len)
+{
+    unsigned int16 remainder = 16;
+    unsigned int16 address;
+    int i;
+
+    for (i = 0 ; i < len ; i++)
+    {
+        address = ((remainder >> 11) ^ (data[i] >> 4)) & 0x0F;
+        remainder = (remainder << 4) ^ g_nibble_table[address];
+        address = ((remainder >> 11) ^ data[i]) & 0x0F;
+        remainder = (remainder << 4) ^ g_nibble_table[address];
+    }
+    return remainder * 2;
+}
+
+static void test_table(void)
+{
+    int i;
+
+    for (i = 0 ; i < 256 ; i++)
+    {
+        CHECK(pec15Table[i] == pec15_entry(i, 8));
+    }
+    for (i = 0 ; i < 16 ; i++)
+    {
+        g_nibble_table[i] = pec15_entry(i, 4);
+    }
+}
+
+// The three implementations agree on random data of every length
+static void test_variants(void)
+{
+    char data[GROUP_BYTES];
+    int len;
+    int n;
+    int i;
+
+    for (n = 0 ; n < 10000 ; n++)
+    {
+        len = 1 + (n % GROUP_BYTES);
+        for (i = 0 ; i < len ; i++)
+        {
+            data[i] = rand();
+        }
+        CHECK(pec15(data, len) == pec15_bitwise(data, len));
+        CHECK(pec15_nibble(data, len) == pec15_bitwise(data, len));
+    }
+}
+
+static unsigned int16 command_pec(unsigned int16 command)
+{
+    char frame[2];
+
+    frame[0] = make8(command, 1);
+    frame[1] = make8(command, 0);
+    return pec15_bitwise(frame, 2);
+}
+
+#define CHECK_COMMAND_PEC(cmd) CHECK(command_pec(cmd) == cmd##_PEC)
+
+// Every precomputed command PEC is the PEC of its command
+static void test_command_pecs(void)
+{
+    int mode;
+    int g;
+
+    CHECK_COMMAND_PEC(WRCFG);
+    CHECK_COMMAND_PEC(RDCFG);
+    CHECK_COMMAND_PEC(RDCVA);
+    CHECK_COMMAND_PEC(RDCVB);
+    CHECK_COMMAND_PEC(RDCVC);
+    CHECK_COMMAND_PEC(RDCVD);
+    CHECK_COMMAND_PEC(RDAUXA);
+    CHECK_COMMAND_PEC(RDAUXB);
+    CHECK_COMMAND_PEC(RDSTATA);
+    CHECK_COMMAND_PEC(RDSTATB);
+    CHECK_COMMAND_PEC(CLRCELL);
+    CHECK_COMMAND_PEC(CLRAUX);
+    CHECK_COMMAND_PEC(CLRSTAT);
+    CHECK_COMMAND_PEC(PLADC);
+    CHECK_COMMAND_PEC(DIAGN);
+    CHECK_COMMAND_PEC(WRCOMM);
+    CHECK_COMMAND_PEC(RDCOMM);
+    CHECK_COMMAND_PEC(STCOMM);
+    CHECK_COMMAND_PEC(ADSTAT_ITMP);
+
+    for (mode = LTC6804_MODE_FAST ; mode <= LTC6804_MODE_FILTERED ; mode++)
+    {
+        CHECK(command_pec(ADCV_CMD(mode)) == g_adcv_pec[mode]);
+        CHECK(command_pec(ADCV_CMD_NO_DCP(mode)) == g_adcv_no_dcp_pec[mode]);
+    }
+
+    for (g = 0 ; g < N_CELL_GROUPS ; g++)
+    {
+        CHECK(command_pec(g_group_cmd[g]) == g_group_pec[g]);
+    }
+}
+
+typedef unsigned int16 (*pec_fn_t)(char *, int);
+
+static double time_pec(pec_fn_t fn, char * data, int len)
+{
+    int pass;
+    double t0 = host_ns();
+
+    for (pass = 0 ; pass < N_PASSES ; pass++)
+    {
+        data[0] = pass;
+        g_sink = fn(data, len);
+    }
+    return (host_ns() - t0) / N_PASSES;
+}
+
+static void benchmark(void)
+{
+    static const struct
+    {
+        const char * name;
+        pec_fn_t     fn;
+    } variants[] =
+    {
+        {"bitwise",      pec15_bitwise},
+        {"nibble table", pec15_nibble},
+        {"byte table",   pec15},
+    };
+    char data[GROUP_DATA_BYTES] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC};
+    unsigned int v;
+
+    printf("%-14s %16s %16s\n", "PEC15", "command ns", "group ns");
+    for (v = 0 ; v < sizeof(variants)/sizeof(variants[0]) ; v++)
+    {
+        printf("%-14s %16.1f %16.1f\n", variants[v].name,
+               time_pec(variants[v].fn, data, 2), time_pec(variants[v].fn, data, GROUP_DATA_BYTES));
+    }
+}
+
+int main(void)
+{
+    test_table();
+    test_variants();
+    test_command_pecs();
+    benchmark();
+    return host_report("test_pec");
+}
@@ -0,0 +1,304 @@
+// PLADC polling of the LTC6804 conversions against a mock of the chips
+//
+// The three LTC6804s are emulated behind the blocking SPI calls. Each chip
+// decodes the command frames sent while its chip select is low, checks
+// their PEC, and starts a conversion of the length its ADC mode takes when
+// it receives ADCV. After PLADC it holds SDO low until that conversion is
+// complete. The MISO mux decides which chip's SDO is read. Every byte moves
+// the simulated clock on by one byte time at the SPI1 rate.
+
+#include "host_time.h"
+
+// Pins of main.h
+#define CSBI1     1
+#define CSBI2     2
+#define CSBI3     3
+#define MISO_SEL0 4
+#define MISO_SEL1 5
+
+// Stub of the DMA transaction engine, the polling uses the blocking calls
+#define SPI_LINK_C
+#define SPI_DMA_C
+#define SPI_BUS_LTC 0
+
+typedef void (*spi_callback_t)(unsigned int8);
+
+typedef struct
+{
+    int16            cs_pin;
+    unsigned int8    mux;
+    unsigned int8    length;
+    unsigned int8    tx_length;
+    unsigned int8  * tx;
+    unsigned int8  * rx;
+    spi_callback_t   callback;
+    unsigned int8    tag;
+} spi_txn_t;
+
+static int1 spi_dma_submit(unsigned int8 bus, spi_txn_t * txn) { return true; }
+static int1 spi_dma_wait(unsigned int8 bus) { return true; }
+static void spi_link_report(unsigned int8 bus, int1 b_error) {}
+static void spi_link_timeout(unsigned int8 bus) {}
+
+static unsigned int8 spi_read(unsigned int8 data);
+static void spi_write(unsigned int8 data);
+
+#include "../ltc6804.c"
+
+// Die temperature conversion time, ADSTAT in the 7kHz mode
+#define ADSTAT_TIME_US 405
+
+// Fixed wait the polling replaced
+#define FIXED_WAIT_US 500
+
+typedef struct
+{
+    int                cs_pin;
+    unsigned int8      mux;
+    unsigned int8      frame[COMMAND_BYTES];
+    unsigned int8      n_bytes;     // Command bytes received since chip select fell
+    int1               b_polling;   // PLADC received, SDO shows the ADC state
+    int1               b_stuck;     // Never completes a conversion
+    unsigned long long adcv_us;     // Time ADCV was received
+    unsigned long long done_us;     // Time the conversion completes
+    unsigned int       bad_pecs;    // Command frames with a bad PEC
+    unsigned int       conversions; // ADCV and ADSTAT commands received
+} mock_chip_t;
+
+static mock_chip_t g_chip[N_LTC6804] =
+{
+    {CSBI1, 0x02},
+    {CSBI2, 0x01},
+    {CSBI3, 0x00},
+};
+
+// Time to clock one byte
+static unsigned int g_byte_us = 64;
+
+static void mock_pin(int pin, int level)
+{
+    int i;
+
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        if ((pin == g_chip[i].cs_pin) && (level == 0))
+        {
+            g_chip[i].n_bytes = 0;
+            g_chip[i].b_polling = false;
+        }
+    }
+}
+
+static void mock_command(mock_chip_t * chip)
+{
+    unsigned int16 cmd = make16(chip->frame[0], chip->frame[1]);
+
+    if (pec15((char *)chip->frame, 2) != make16(chip->frame[2], chip->frame[3]))
+    {
+        chip->bad_pecs++;
+        return;
+    }
+
+    if ((cmd & ~(ADCV_DCP | 0x0180)) == ADCV)
+    {
+        chip->conversions++;
+        chip->adcv_us = g_host_us;
+        chip->done_us = g_host_us + ltc6804_conversion_time_us((cmd >> 7) & 0x03);
+    }
+    else if (cmd == ADSTAT_ITMP)
+    {
+        chip->conversions++;
+        chip->done_us = g_host_us + ADSTAT_TIME_US;
+    }
+    else if (cmd == PLADC)
+    {
+        chip->b_polling = true;
+    }
+}
+
+// Clocks one byte: every selected chip receives it, the chip the MISO mux
+// routes to SDO answers
+static unsigned int8 mock_transfer(unsigned int8 data)
+{
+    int i;
+    unsigned int8 mux = g_host_pin[MISO_SEL0] | (g_host_pin[MISO_SEL1] << 1);
+    unsigned int8 sdo = 0xFF;
+
+    host_delay_us(g_byte_us);
+
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        if (g_host_pin[g_chip[i].cs_pin] != 0)
+        {
+            continue;
+        }
+
+        if ((g_chip[i].mux == mux) && g_chip[i].b_polling)
+        {
+            if (g_chip[i].b_stuck || (g_host_us < g_chip[i].done_us))
+            {
+                sdo = 0x00;
+            }
+        }
+
+        if (g_chip[i].n_bytes < COMMAND_BYTES)
+        {
+            g_chip[i].frame[g_chip[i].n_bytes] = data;
+            g_chip[i].n_bytes++;
+            if (g_chip[i].n_bytes == COMMAND_BYTES)
+            {
+                mock_command(&g_chip[i]);
+            }
+        }
+    }
+    return sdo;
+}
+
+static unsigned int8 spi_read(unsigned int8 data)
+{
+    return mock_transfer(data);
+}
+
+static void spi_write(unsigned int8 data)
+{
+    mock_transfer(data);
+}
+
+static void reset_chips(void)
+{
+    int i;
+
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        g_chip[i].b_stuck = false;
+        g_chip[i].bad_pecs = 0;
+        g_chip[i].conversions = 0;
+        g_ltc6804_pladc_faults[i] = 0;
+    }
+}
+
+// The wait ends once the last chip has converted, within a poll of the
+// remaining chips, and no chip is counted as a fault
+static void test_mode(ltc6804_mode_t mode, unsigned int byte_us)
+{
+    int i;
+    unsigned long long done_us = 0;
+    unsigned long long start_us;
+    unsigned long long waited_us;
+
+    reset_chips();
+    g_byte_us = byte_us;
+    ltc6804_set_mode(mode);
+    ltc6804_start_cell_conversion();
+    start_us = g_host_us;
+    ltc6804_wait_cell_conversion();
+    waited_us = g_host_us - start_us;
+
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        CHECK(g_chip[i].bad_pecs == 0);
+        CHECK(g_chip[i].conversions == 1);
+        CHECK(g_ltc6804_pladc_faults[i] == 0);
+        if (g_chip[i].done_us > done_us)
+        {
+            done_us = g_chip[i].done_us;
+        }
+    }
+    CHECK(g_host_us >= done_us);
+    CHECK(g_host_us <= done_us + (N_LTC6804*(COMMAND_BYTES+1) + 1)*byte_us);
+
+    printf("mode %d, %3uus/byte: conversion %6uus, polled %6lluus, fixed wait %uus\n",
+           mode, byte_us, ltc6804_conversion_time_us(mode), waited_us, FIXED_WAIT_US);
+}
+
+// The filtered conversion is only collected once its time has passed, and
+// is then complete at the first poll
+static void test_filtered(void)
+{
+    int i;
+
+    reset_chips();
+    g_byte_us = 64;
+    ltc6804_set_mode(LTC6804_MODE_FILTERED);
+    ltc6804_start_cell_conversion();
+    CHECK(ltc6804_cell_conversion_due() == false);
+    host_delay_us(ltc6804_conversion_time_us(LTC6804_MODE_FILTERED) - 2000);
+    CHECK(ltc6804_cell_conversion_due() == false);
+    host_delay_us(2000 + 1000);
+    CHECK(ltc6804_cell_conversion_due() == true);
+
+    ltc6804_wait_cell_conversion();
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        CHECK(g_ltc6804_pladc_faults[i] == 0);
+    }
+}
+
+// A chip that never completes is given up on at the timeout and counted,
+// and the chips after it, which completed meanwhile, are not blamed for it
+static void test_stuck_chip(unsigned int8 stuck)
+{
+    int i;
+    unsigned long long start_us;
+
+    reset_chips();
+    g_byte_us = 8;
+    g_chip[stuck].b_stuck = true;
+    ltc6804_set_mode(LTC6804_MODE_NORMAL);
+    ltc6804_start_cell_conversion();
+    start_us = g_host_us;
+    ltc6804_wait_cell_conversion();
+
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        CHECK(g_ltc6804_pladc_faults[i] == (i == stuck));
+    }
+    CHECK(g_host_us - start_us >= LTC6804_CONVERSION_TIMEOUT_US);
+    CHECK(g_host_us - start_us <= LTC6804_CONVERSION_TIMEOUT_US + N_LTC6804*(COMMAND_BYTES+2)*g_byte_us);
+}
+
+// The die temperature read polls its own ADSTAT conversion the same way
+static void test_die_temperature(void)
+{
+    int i;
+
+    reset_chips();
+    g_byte_us = 8;
+    ltc6804_read_die_temperatures();
+    for (i = 0 ; i < N_LTC6804 ; i++)
+    {
+        CHECK(g_chip[i].conversions == 1);
+        CHECK(g_ltc6804_pladc_faults[i] == 0);
+        CHECK(g_host_us >= g_chip[i].done_us);
+    }
+
+    reset_chips();
+    g_chip[0].b_stuck = true;
+    ltc6804_read_die_temperatures();
+    CHECK(g_ltc6804_pladc_faults[0] == 1);
+    CHECK(g_ltc6804_pladc_faults[1] == 0);
+    CHECK(g_ltc6804_pladc_faults[2] == 0);
+}
+
+int main(void)
+{
+    static const unsigned int byte_us[] = {64, 8};
+    unsigned int b;
+    unsigned int8 chip;
+
+    gp_host_pin_hook = mock_pin;
+    ltc6804_init();
+
+    for (b = 0 ; b < sizeof(byte_us)/sizeof(byte_us[0]) ; b++)
+    {
+        test_mode(LTC6804_MODE_FAST, byte_us[b]);
+        test_mode(LTC6804_MODE_NORMAL, byte_us[b]);
+    }
+    test_filtered();
+    for (chip = 0 ; chip < N_LTC6804 ; chip++)
+    {
+        test_stuck_chip(chip);
+    }
+    test_die_temperature();
+    return host_report("test_pladc");
+}
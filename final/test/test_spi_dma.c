@@ -0,0 +1,517 @@
+// SPI transaction engine against an emulated DMA controller
+//
+// Runs the DMA backend of spi_dma.c on host copies of the SFRs. The emulated
+// controller starts a transfer when the transmit channel of a bus is forced,
+// takes 8 bit times per byte at the clock spi_link.c has set for the bus, and
+// then raises the receive channel interrupt, which is held off while the
+// driver has it disabled. The devices on the buses answer every byte with
+// the byte sent inverted, and every pin change and byte is traced.
+//
+// The timebase is replaced by the clock of the emulator: every read of the
+// millisecond count moves it on by EMU_STEP_NS, so the busy wait in
+// spi_dma_wait() lets the transfers of both buses run.
+
+#include "host.h"
+
+// Pins of main.h
+#define CSBI1     1
+#define CSBI2     2
+#define CSBI3     3
+#define MISO_SEL0 4
+#define MISO_SEL1 5
+#define ADC1_SEL  6
+#define ADC2_SEL  7
+
+// Interrupts of the DMA receive channels
+#define INT_DMA5 0
+#define INT_DMA7 1
+
+#define getenv(sfr) 0
+
+void host_delay_us(unsigned long long us);
+void enable_interrupts(int irq);
+void disable_interrupts(int irq);
+void clear_interrupt(int irq);
+
+// Stub of the timebase, runs the emulator
+#define TIMEBASE_C
+unsigned int32 timebase_ms(void);
+
+#include "host/spi_link.c"
+
+#define EMU_STEP_NS 100
+
+#define N_TRACE 4096
+
+typedef enum
+{
+    TRACE_PIN,
+    TRACE_BYTE,
+    TRACE_CALLBACK,
+} trace_kind_t;
+
+typedef struct
+{
+    trace_kind_t  kind;
+    unsigned int8 bus;
+    int           pin;   // Pin that changed, or chip select low during the byte
+    int           level; // Level of the pin
+    unsigned int8 mux;   // MISO mux during the byte
+    unsigned int8 data;  // Byte sent, or tag of the callback
+} trace_t;
+
+typedef struct
+{
+    int1               b_running;
+    int1               b_stuck;  // Never completes the transfer
+    unsigned long long done_ns;  // Time the last byte is clocked
+    unsigned int8      length;
+    int1               b_irq_pending;
+    int1               b_irq_enabled;
+} emu_bus_t;
+
+static unsigned long long g_emu_ns = 0;
+static emu_bus_t g_emu[N_SPI_BUSES];
+static trace_t g_trace[N_TRACE];
+static int g_n_trace = 0;
+
+static void trace(trace_kind_t kind, unsigned int8 bus, int pin, int level, unsigned int8 data)
+{
+    if (g_n_trace < N_TRACE)
+    {
+        g_trace[g_n_trace].kind  = kind;
+        g_trace[g_n_trace].bus   = bus;
+        g_trace[g_n_trace].pin   = pin;
+        g_trace[g_n_trace].level = level;
+        g_trace[g_n_trace].mux   = g_host_pin[MISO_SEL0] | (g_host_pin[MISO_SEL1] << 1);
+        g_trace[g_n_trace].data  = data;
+        g_n_trace++;
+    }
+}
+
+static void emu_pin(int pin, int level)
+{
+    trace(TRACE_PIN, 0, pin, level, 0);
+}
+
+// Chip select of a bus that is low, -1 if none
+static int emu_selected(unsigned int8 bus)
+{
+    static const int ltc[] = {CSBI1, CSBI2, CSBI3};
+    static const int adc[] = {ADC1_SEL, ADC2_SEL};
+    int i;
+
+    if (bus == SPI_BUS_LTC)
+    {
+        for (i = 0 ; i < 3 ; i++)
+        {
+            if (g_host_pin[ltc[i]] == 0)
+            {
+                return ltc[i];
+            }
+        }
+    }
+    else
+    {
+        for (i = 0 ; i < 2 ; i++)
+        {
+            if (g_host_pin[adc[i]] == 0)
+            {
+                return adc[i];
+            }
+        }
+    }
+    return -1;
+}
+
+static void emu_irq(unsigned int8 bus)
+{
+    if (g_emu[bus].b_irq_enabled == false)
+    {
+        g_emu[bus].b_irq_pending = true;
+        return;
+    }
+    g_emu[bus].b_irq_pending = false;
+    if (bus == SPI_BUS_LTC)
+    {
+        isr_dma5();
+    }
+    else
+    {
+        isr_dma7();
+    }
+}
+
+void enable_interrupts(int irq)
+{
+    g_emu[irq].b_irq_enabled = true;
+    if (g_emu[irq].b_irq_pending)
+    {
+        emu_irq(irq);
+    }
+}
+
+void disable_interrupts(int irq)
+{
+    g_emu[irq].b_irq_enabled = false;
+}
+
+void clear_interrupt(int irq)
+{
+    g_emu[irq].b_irq_pending = false;
+}
+
+// Starts a forced transfer and completes a finished one on a bus
+static void emu_bus(unsigned int8 bus)
+{
+    volatile unsigned short * con_tx = (bus == SPI_BUS_LTC) ? &DMA4CON : &DMA6CON;
+    volatile unsigned short * con_rx = (bus == SPI_BUS_LTC) ? &DMA5CON : &DMA7CON;
+    volatile unsigned short * req_tx = (bus == SPI_BUS_LTC) ? &DMA4REQ : &DMA6REQ;
+    volatile unsigned short * cnt_tx = (bus == SPI_BUS_LTC) ? &DMA4CNT : &DMA6CNT;
+    volatile unsigned short * cnt_rx = (bus == SPI_BUS_LTC) ? &DMA5CNT : &DMA7CNT;
+    emu_bus_t * emu = &g_emu[bus];
+    unsigned int8 i;
+
+    // Disabling the channels stops a transfer
+    if (emu->b_running && (((*con_tx | *con_rx) & 0x8000) != 0x8000))
+    {
+        emu->b_running = false;
+    }
+
+    if ((emu->b_running == false) && (*req_tx & DMA_REQ_FORCE))
+    {
+        CHECK((*con_tx & 0x8000) && (*con_rx & 0x8000));
+        CHECK(*cnt_tx == *cnt_rx);
+        *req_tx &= ~DMA_REQ_FORCE;
+        emu->b_running = true;
+        emu->length = *cnt_tx + 1;
+        emu->done_ns = g_emu_ns + (unsigned long long)emu->length * 8000000 / spi_link_khz(bus);
+    }
+
+    if (emu->b_running && (emu->b_stuck == false) && (g_emu_ns >= emu->done_ns))
+    {
+        for (i = 0 ; i < emu->length ; i++)
+        {
+            trace(TRACE_BYTE, bus, emu_selected(bus), 0, g_spi_dma_tx[bus][i]);
+            g_spi_dma_rx[bus][i] = ~g_spi_dma_tx[bus][i];
+        }
+        emu->b_running = false;
+        *con_tx &= ~0x8000;
+        *con_rx &= ~0x8000;
+        emu_irq(bus);
+    }
+}
+
+static void emu_step(void)
+{
+    emu_bus(SPI_BUS_LTC);
+    emu_bus(SPI_BUS_ADC);
+    g_emu_ns += EMU_STEP_NS;
+    g_host_us = g_emu_ns / 1000;
+}
+
+void host_delay_us(unsigned long long us)
+{
+    unsigned long long end = g_emu_ns + us*1000;
+
+    while (g_emu_ns < end)
+    {
+        emu_step();
+    }
+}
+
+unsigned int32 timebase_ms(void)
+{
+    emu_step();
+    return g_emu_ns / 1000000;
+}
+
+static void callback(unsigned int8 tag)
+{
+    trace(TRACE_CALLBACK, 0, 0, 0, tag);
+}
+
+// Collects the tags of the callbacks run so far, returns how many ran
+static int callbacks(unsigned int8 * tags)
+{
+    int i;
+    int n = 0;
+
+    for (i = 0 ; i < g_n_trace ; i++)
+    {
+        if (g_trace[i].kind == TRACE_CALLBACK)
+        {
+            tags[n++] = g_trace[i].data;
+        }
+    }
+    return n;
+}
+
+static void reset(void)
+{
+    memset(g_emu, 0, sizeof(g_emu));
+    spi_link_init();
+    spi_dma_init();
+    g_n_trace = 0;
+}
+
+// Chip select, mux, bytes, stored reply and callback of three transactions
+// on SPI1, in submission order
+static void test_sequencing(void)
+{
+    static unsigned int8 tx[3][4] = {{0x00, 0x04, 0x07, 0xC2}, {0x07, 0x14, 0xF3, 0x6C}, {0xAA}};
+    static unsigned int8 rx[3][SPI_MAX_BYTES];
+    static const int cs[3] = {CSBI1, CSBI2, CSBI3};
+    static const unsigned int8 mux[3] = {0x02, 0x01, SPI_NO_MUX};
+    static const unsigned int8 length[3] = {12, 5, 3};
+    static const unsigned int8 tx_length[3] = {4, 4, 1};
+    spi_txn_t txn;
+    int t;
+    int i;
+    int n = 0;
+    int bytes;
+
+    reset();
+    gp_host_pin_hook = emu_pin;
+    for (t = 0 ; t < 3 ; t++)
+    {
+        txn.cs_pin    = cs[t];
+        txn.mux       = mux[t];
+        txn.length    = length[t];
+        txn.tx_length = tx_length[t];
+        txn.tx        = tx[t];
+        txn.rx        = rx[t];
+        txn.callback  = callback;
+        txn.tag       = 10 + t;
+        CHECK(spi_dma_submit(SPI_BUS_LTC, &txn) == true);
+    }
+    CHECK(spi_dma_wait(SPI_BUS_LTC) == true);
+    gp_host_pin_hook = 0;
+
+    for (t = 0 ; t < 3 ; t++)
+    {
+        // The mux is routed before the chip select falls
+        if (mux[t] != SPI_NO_MUX)
+        {
+            CHECK((g_trace[n].kind == TRACE_PIN) && (g_trace[n].pin == MISO_SEL0));
+            CHECK((g_trace[n+1].kind == TRACE_PIN) && (g_trace[n+1].pin == MISO_SEL1));
+            n += 2;
+        }
+        CHECK((g_trace[n].kind == TRACE_PIN) && (g_trace[n].pin == cs[t]) && (g_trace[n].level == 0));
+        n++;
+
+        // Every byte is clocked with the chip selected, the transmit bytes
+        // followed by the fill byte
+        for (bytes = 0 ; (n < g_n_trace) && (g_trace[n].kind == TRACE_BYTE) ; bytes++, n++)
+        {
+            CHECK(g_trace[n].pin == cs[t]);
+            if (mux[t] != SPI_NO_MUX)
+            {
+                CHECK(g_trace[n].mux == mux[t]);
+            }
+            CHECK(g_trace[n].data == ((bytes < tx_length[t]) ? tx[t][bytes] : SPI_FILL_BYTE));
+        }
+        CHECK(bytes == length[t]);
+
+        // The chip select rises before the callback runs
+        CHECK((g_trace[n].kind == TRACE_PIN) && (g_trace[n].pin == cs[t]) && (g_trace[n].level == 1));
+        CHECK((g_trace[n+1].kind == TRACE_CALLBACK) && (g_trace[n+1].data == 10 + t));
+        n += 2;
+
+        for (i = 0 ; i < length[t] ; i++)
+        {
+            CHECK(rx[t][i] == (unsigned int8)~((i < tx_length[t]) ? tx[t][i] : SPI_FILL_BYTE));
+        }
+    }
+    CHECK(n == g_n_trace);
+}
+
+// A full queue refuses the transaction instead of overwriting one, and the
+// accepted ones all complete in order
+static void test_queue_full(void)
+{
+    static unsigned int8 tx[2] = {0x12, 0x34};
+    unsigned int8 tags[N_TRACE];
+    spi_txn_t txn;
+    int accepted = 0;
+    int i;
+
+    reset();
+    txn.cs_pin    = ADC1_SEL;
+    txn.mux       = SPI_NO_MUX;
+    txn.length    = 2;
+    txn.tx_length = 2;
+    txn.tx        = tx;
+    txn.rx        = 0;
+    txn.callback  = callback;
+    for (i = 0 ; i < SPI_QUEUE_LENGTH + 4 ; i++)
+    {
+        txn.tag = i;
+        if (spi_dma_submit(SPI_BUS_ADC, &txn) == true)
+        {
+            accepted++;
+        }
+    }
+    CHECK(accepted == SPI_QUEUE_LENGTH - 1);
+    CHECK(spi_dma_wait(SPI_BUS_ADC) == true);
+
+    CHECK(callbacks(tags) == accepted);
+    for (i = 0 ; i < accepted ; i++)
+    {
+        CHECK(tags[i] == i);
+    }
+}
+
+// A transfer that never completes aborts the bus within the timeout, raises
+// its chip select, drops the queue without callbacks and ignores a late
+// completion. The bus works again afterwards.
+static void test_timeout(void)
+{
+    static unsigned int8 tx[4] = {0x00, 0x04, 0x07, 0xC2};
+    unsigned int8 tags[N_TRACE];
+    spi_txn_t txn;
+    unsigned long long start_ns;
+    int i;
+
+    reset();
+    txn.cs_pin    = CSBI2;
+    txn.mux       = 0x01;
+    txn.length    = 12;
+    txn.tx_length = 4;
+    txn.tx        = tx;
+    txn.rx        = 0;
+    txn.callback  = callback;
+    for (i = 0 ; i < 4 ; i++)
+    {
+        txn.tag = i;
+        spi_dma_submit(SPI_BUS_LTC, &txn);
+    }
+
+    // The second transaction hangs
+    while (callbacks(tags) == 0)
+    {
+        timebase_ms();
+    }
+    g_emu[SPI_BUS_LTC].b_stuck = true;
+    start_ns = g_emu_ns;
+    CHECK(spi_dma_wait(SPI_BUS_LTC) == false);
+    CHECK(g_emu_ns - start_ns >= SPI_DMA_TIMEOUT_MS*1000000ULL);
+    CHECK(g_emu_ns - start_ns <= (SPI_DMA_TIMEOUT_MS+2)*1000000ULL);
+    CHECK(g_host_pin[CSBI2] == 1);
+    CHECK(spi_dma_busy(SPI_BUS_LTC) == false);
+    CHECK(((DMA4CON | DMA5CON) & 0x8000) == 0);
+
+    isr_dma5();
+    CHECK(callbacks(tags) == 1);
+    CHECK(spi_dma_busy(SPI_BUS_LTC) == false);
+
+    g_emu[SPI_BUS_LTC].b_stuck = false;
+    txn.tag = 9;
+    spi_dma_submit(SPI_BUS_LTC, &txn);
+    CHECK(spi_dma_wait(SPI_BUS_LTC) == true);
+    CHECK(callbacks(tags) == 2);
+    CHECK(tags[1] == 9);
+}
+
+// Runs an LTC6804 scan and an ADS7952 sweep at the given speed levels,
+// returns the time both took together and each alone in microseconds
+static void run_scan(unsigned int8 ltc_level, unsigned int8 adc_level, double * both, double * ltc, double * adc)
+{
+    static unsigned int8 ltc_tx[4] = {0x00, 0x04, 0x07, 0xC2};
+    static unsigned int8 adc_tx[2] = {0x20, 0x00};
+    static unsigned int8 ltc_rx[12][12];
+    static unsigned int8 adc_rx[24][2];
+    spi_txn_t txn;
+    unsigned long long start_ns;
+    unsigned long long ltc_ns = 0;
+    unsigned long long adc_ns = 0;
+    int i;
+    int pass;
+
+    for (pass = 0 ; pass < 3 ; pass++)
+    {
+        reset();
+        g_spi_link[SPI_BUS_LTC].level = ltc_level;
+        g_spi_link[SPI_BUS_ADC].level = adc_level;
+        start_ns = g_emu_ns;
+
+        if (pass != 2)
+        {
+            txn.mux       = 0x02;
+            txn.length    = 12;
+            txn.tx_length = 4;
+            txn.tx        = ltc_tx;
+            txn.callback  = 0;
+            for (i = 0 ; i < 10 ; i++)
+            {
+                txn.cs_pin = (i < 4) ? CSBI1 : (i < 8) ? CSBI2 : CSBI3;
+                txn.rx     = ltc_rx[i];
+                spi_dma_submit(SPI_BUS_LTC, &txn);
+            }
+        }
+        if (pass != 1)
+        {
+            txn.mux       = SPI_NO_MUX;
+            txn.length    = 2;
+            txn.tx_length = 2;
+            txn.tx        = adc_tx;
+            for (i = 0 ; i < 24 ; i++)
+            {
+                txn.cs_pin = (i < 12) ? ADC1_SEL : ADC2_SEL;
+                txn.rx     = adc_rx[i];
+                spi_dma_submit(SPI_BUS_ADC, &txn);
+            }
+        }
+
+        // The CPU is free until it waits
+        CHECK(g_emu_ns == start_ns);
+        CHECK(spi_dma_wait(SPI_BUS_LTC) == true);
+        ltc_ns = g_emu_ns - start_ns;
+        CHECK(spi_dma_wait(SPI_BUS_ADC) == true);
+        adc_ns = g_emu_ns - start_ns;
+
+        if (pass == 0)
+        {
+            *both = (ltc_ns > adc_ns ? ltc_ns : adc_ns) / 1000.0;
+        }
+        else if (pass == 1)
+        {
+            *ltc = ltc_ns / 1000.0;
+        }
+        else
+        {
+            *adc = adc_ns / 1000.0;
+        }
+    }
+}
+
+// Both buses transfer at the same time, at every speed level
+static void test_concurrent(void)
+{
+    unsigned int8 level;
+    double both = 0;
+    double ltc = 0;
+    double adc = 0;
+
+    printf("%8s %8s %14s %14s %14s\n", "SPI1 kHz", "SPI2 kHz", "LTC scan us", "ADC sweep us", "together us");
+    for (level = 0 ; level < N_SPI_LINK_LEVELS ; level++)
+    {
+        run_scan(level < SPI_LINK_MAX_LTC ? level : SPI_LINK_MAX_LTC, level, &both, &ltc, &adc);
+        printf("%8u %8u %14.1f %14.1f %14.1f\n",
+               g_spi_link_khz[level < SPI_LINK_MAX_LTC ? level : SPI_LINK_MAX_LTC], g_spi_link_khz[level],
+               ltc, adc, both);
+
+        // The scans overlap, together they take as long as the longer one
+        CHECK(both < ltc + adc);
+        CHECK(both <= (ltc > adc ? ltc : adc) + 1.0);
+    }
+}
+
+int main(void)
+{
+    test_sequencing();
+    test_queue_full();
+    test_timeout();
+    test_concurrent();
+    return host_report("test_spi_dma");
+}
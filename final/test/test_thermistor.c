@@ -0,0 +1,171 @@
+// Thermistor lookup table against the Steinhart-Hart equation it replaced
+//
+// Checks thermistor_convert_data() against the float conversion adc.c used
+// to run for every ADS7952 code, and the raw codes of the protection limits
+// against the equation. Then times a pass over the 24 channels with both.
+// The host has a floating point unit and the PIC24 does not, so the float
+// time here is far below what it costs on the target.
+
+#include <math.h>
+#include "host_time.h"
+
+// Stub of the SPI driver, the conversion does not touch the bus
+#define SPI_LINK_C
+#define SPI_DMA_C
+#define SPI_BUS_ADC 1
+#define SPI_NO_MUX  0xFF
+#define ADC1_SEL    1
+#define ADC2_SEL    2
+
+typedef void (*spi_callback_t)(unsigned int8);
+
+typedef struct
+{
+    int16            cs_pin;
+    unsigned int8    mux;
+    unsigned int8    length;
+    unsigned int8    tx_length;
+    unsigned int8  * tx;
+    unsigned int8  * rx;
+    spi_callback_t   callback;
+    unsigned int8    tag;
+} spi_txn_t;
+
+static void spi_write2(unsigned int8 data) {}
+static int1 spi_dma_submit(unsigned int8 bus, spi_txn_t * txn) { return true; }
+static int1 spi_dma_wait(unsigned int8 bus) { return true; }
+static void spi_link_report(unsigned int8 bus, int1 b_error) {}
+static void spi_link_timeout(unsigned int8 bus) {}
+
+#include "../adc.c"
+
+#define N_PASSES 200000
+
+// Error allowed from -20 to 100 degC, the range the protection limits use
+#define MAX_ERROR_DEGC 0.25
+
+static volatile double         g_float_sink;
+static volatile signed int16   g_table_sink;
+static unsigned int16          g_codes[N_ADC_CHANNELS];
+
+// The conversion adc.c ran before the table, in double precision
+static double steinhart_hart(unsigned int16 raw)
+{
+    double resistance;
+    double temperature;
+
+    if (raw == 0)
+    {
+        raw = 1;
+    }
+    resistance = THERMISTOR_SERIES * raw / (LSBS_PER_VOLT * THERMISTOR_SUPPLY - raw);
+    temperature = log(resistance / THERMISTOR_NOMINAL) / B_COEFF;
+    temperature += 1.0 / (TEMPERATURE_NOMINAL + 273.15);
+    return 1.0 / temperature - 273.15;
+}
+
+// Same, in the single precision the firmware used
+static float steinhart_hart_float(unsigned int16 raw)
+{
+    float resistance;
+    float temperature;
+
+    resistance = THERMISTOR_SERIES * (float)(raw) / (LSBS_PER_VOLT * THERMISTOR_SUPPLY - (float)(raw));
+    temperature = resistance / THERMISTOR_NOMINAL;
+    temperature = logf(temperature);
+    temperature /= B_COEFF;
+    temperature += 1.0 / (TEMPERATURE_NOMINAL + 273.15);
+    temperature = 1.0 / temperature;
+    temperature -= 273.15;
+    return temperature;
+}
+
+// Every code in range is within MAX_ERROR_DEGC, and the table never runs
+// the wrong way, which would let a hotter cell read cooler
+static void test_accuracy(void)
+{
+    unsigned int16 raw;
+    double reference;
+    double error;
+    double worst = 0;
+    unsigned int16 worst_raw = 0;
+    signed int16 previous = 32767;
+    signed int16 converted;
+
+    for (raw = 0 ; raw < 4096 ; raw++)
+    {
+        converted = thermistor_convert_data(raw);
+        CHECK(converted <= previous);
+        previous = converted;
+
+        reference = steinhart_hart(raw);
+        if ((reference >= -20.0) && (reference <= 100.0))
+        {
+            error = fabs(converted/10.0 - reference);
+            if (error > worst)
+            {
+                worst = error;
+                worst_raw = raw;
+            }
+        }
+    }
+    printf("worst error from -20 to 100 degC: %.3f degC at code %u\n", worst, worst_raw);
+    CHECK(worst <= MAX_ERROR_DEGC);
+}
+
+// Each limit code is the last code at or above its limit, so comparing raw
+// codes trips at the same temperature the float compare did
+static void test_limit_code(unsigned int16 code, double limit)
+{
+    printf("limit %.0f degC: code %u, %.3f degC, next code %.3f degC\n",
+           limit, code, steinhart_hart(code), steinhart_hart(code + 1));
+    CHECK(steinhart_hart(code) >= limit);
+    CHECK(steinhart_hart(code + 1) < limit);
+}
+
+static void benchmark(void)
+{
+    int i;
+    int pass;
+    double t0;
+    double float_ns;
+    double table_ns;
+
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        g_codes[i] = 800 + rand() % 2400;
+    }
+
+    t0 = host_ns();
+    for (pass = 0 ; pass < N_PASSES ; pass++)
+    {
+        g_codes[pass % N_ADC_CHANNELS] ^= 1;
+        for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+        {
+            g_float_sink = steinhart_hart_float(g_codes[i]);
+        }
+    }
+    float_ns = (host_ns() - t0) / N_PASSES;
+
+    t0 = host_ns();
+    for (pass = 0 ; pass < N_PASSES ; pass++)
+    {
+        g_codes[pass % N_ADC_CHANNELS] ^= 1;
+        for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+        {
+            g_table_sink = thermistor_convert_data(g_codes[i]);
+        }
+    }
+    table_ns = (host_ns() - t0) / N_PASSES;
+
+    printf("24 channels: float log %.1f ns/pass, table %.1f ns/pass\n", float_ns, table_ns);
+}
+
+int main(void)
+{
+    test_accuracy();
+    test_limit_code(THERMISTOR_CODE(60), 60.0);
+    test_limit_code(THERMISTOR_CODE(70), 70.0);
+    benchmark();
+    return host_report("test_thermistor");
+}
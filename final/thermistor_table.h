@@ -0,0 +1,42 @@
+#ifndef THERMISTOR_TABLE_H
+#define THERMISTOR_TABLE_H
+
+// Generated by gen_thermistor_table.py, do not edit by hand
+// B_COEFF = 3350, THERMISTOR_SERIES = 10000, THERMISTOR_NOMINAL = 2500
+// TEMPERATURE_NOMINAL = 25, THERMISTOR_SUPPLY = 3.3, LSBS_PER_VOLT = 1820.44
+// Worst case interpolation error from -20 to 100 degC: 0.20 degC
+
+#define THERMISTOR_TABLE_SHIFT 5
+#define THERMISTOR_TABLE_STEP  32
+#define N_THERMISTOR_TABLE     129
+
+// Temperature in 0.1 degC at every THERMISTOR_TABLE_STEP ADS7952 codes
+const signed int16 g_thermistor_table[N_THERMISTOR_TABLE] =
+{
+      5811,   1800,   1409,   1209,   1077,    981,    905,    843,
+       791,    746,    706,    671,    639,    610,    584,    560,
+       537,    516,    496,    478,    460,    444,    428,    413,
+       399,    385,    372,    359,    347,    336,    324,    313,
+       303,    293,    283,    273,    264,    255,    246,    237,
+       229,    221,    213,    205,    197,    190,    182,    175,
+       168,    161,    154,    147,    141,    134,    128,    122,
+       115,    109,    103,     97,     92,     86,     80,     74,
+        69,     63,     58,     52,     47,     42,     37,     31,
+        26,     21,     16,     11,      6,      1,     -4,     -9,
+       -13,    -18,    -23,    -28,    -32,    -37,    -42,    -46,
+       -51,    -55,    -60,    -65,    -69,    -74,    -78,    -83,
+       -87,    -91,    -96,   -100,   -105,   -109,   -113,   -118,
+      -122,   -127,   -131,   -135,   -140,   -144,   -149,   -153,
+      -157,   -162,   -166,   -170,   -175,   -179,   -184,   -188,
+      -192,   -197,   -201,   -206,   -210,   -215,   -219,   -224,
+      -229
+};
+
+// Largest ADS7952 code at or above each protection limit (NTC, so hotter
+// cells read lower codes). Use THERMISTOR_CODE(degc) to look one up.
+#define THERMISTOR_CODE_60  428
+#define THERMISTOR_CODE_70  325
+#define THERMISTOR_CODE(degc) _THERMISTOR_CODE(degc)
+#define _THERMISTOR_CODE(degc) THERMISTOR_CODE_##degc
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef TIMEBASE_C
+#define TIMEBASE_C
+
+// Free running timer used to time short intervals (acquisition stages, waits)
+// Timer 3 runs from the 10MHz instruction clock divided by 8, so one tick is
+// 0.8us and the 16 bit counter wraps every 52ms. Intervals are measured by
+// subtracting two tick readings, which is valid across a single wrap.
+
+#define TIMEBASE_TICKS_PER_MS 1250
+
+// Milliseconds since boot, incremented by the 1ms timer 4 interrupt
+static unsigned int32 g_timebase_ms = 0;
+
+// Converts between microseconds and timebase ticks
+#define TIMEBASE_US_TO_TICKS(us)    ((unsigned int16)(((int32)(us)*5)/4))
+#define TIMEBASE_TICKS_TO_US(ticks) ((unsigned int16)(((int32)(ticks)*4)/5))
+
+// Starts the free running timer
+void timebase_init(void)
+{
+    setup_timer3(TMR_INTERNAL|TMR_DIV_BY_8,0xFFFF);
+}
+
+// Returns the current timebase tick count
+unsigned int16 timebase_ticks(void)
+{
+    return get_timer3();
+}
+
+// Returns the number of ticks elapsed since start
+unsigned int16 timebase_elapsed(unsigned int16 start)
+{
+    return get_timer3() - start;
+}
+
+// Advances the millisecond count, called from the 1ms timer interrupt
+void timebase_tick_ms(void)
+{
+    g_timebase_ms++;
+}
+
+// Returns the number of milliseconds since boot
+// The 32 bit count is read twice so an interrupt between the two halves
+// cannot produce a torn value
+unsigned int32 timebase_ms(void)
+{
+    unsigned int32 ms;
+    
+    do
+    {
+        ms = g_timebase_ms;
+    } while (ms != g_timebase_ms);
+    
+    return ms;
+}
+
+// Returns 1 once the millisecond count has reached deadline
+// Valid for deadlines up to 24 days away, across the 32 bit wrap
+int1 timebase_deadline_passed(unsigned int32 deadline)
+{
+    return ((signed int32)(timebase_ms() - deadline) >= 0);
+}
+
+#endif